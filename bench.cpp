@@ -0,0 +1,306 @@
+#include "dbUtils.h"
+#include "rng.h"
+#include "rules.h"
+#include "scores.h"
+
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/nondet_random.hpp>
+
+#include <ctime>
+#include <iostream>
+#include <string>
+
+double seconds()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+int deviceRand(int n)
+{
+	static boost::random_device dev;
+	return int(dev()%n);
+}
+
+// Reshuffles a discard pile of the given size into an empty deck over and over
+int benchShuffle(int numCards, int rounds)
+{
+	Hand discards;
+	for(int i = 0; i < numCards; ++i)
+	{
+		CardP card(new Card);
+		card->_name = "Card" + boost::lexical_cast<std::string>(i);
+		card->_deck = 1;
+		card->_maxCount = 1;
+		card->_supplement = false;
+		card->_type = (i%10)?Card::Normal:Card::NonTradable;
+		discards.insert(card);
+	}
+
+	Deck deck;
+	double start = seconds();
+	for(int i = 0; i < rounds; ++i)
+	{
+		deck.clear();
+		ShuffleIn(deck, discards);
+	}
+	double elapsed = seconds()-start;
+	std::cout << "ShuffleIn\t" << rounds << " x " << numCards << " cards\t"
+		<< elapsed << "s\t" << numCards*double(rounds)/elapsed << " cards/s" << std::endl;
+
+	Deck raw(discards.begin(), discards.end());
+	start = seconds();
+	for(int i = 0; i < rounds; ++i)
+		std::random_shuffle(raw.begin(), raw.end(), deviceRand);
+	elapsed = seconds()-start;
+	std::cout << "random_device\t" << rounds << " x " << numCards << " cards\t"
+		<< elapsed << "s\t" << numCards*double(rounds)/elapsed << " cards/s" << std::endl;
+	return ErrNone;
+}
+
+// Deals a catalog of the given size per deck to the given number of powers
+int benchCreate(int cardsPerDeck, int numPowers, int rounds)
+{
+	Game g("", true);
+	g._vars["ruleset"] = "AdvCiv";
+	for(int deck = 1; deck < 10; ++deck)
+	{
+		for(int i = 0; i < cardsPerDeck; ++i)
+		{
+			CardP card(new Card);
+			card->_name = "Card" + boost::lexical_cast<std::string>(deck) + "_" + boost::lexical_cast<std::string>(i);
+			card->_deck = deck;
+			card->_maxCount = 1 + i%8;
+			card->_supplement = false;
+			const int kind = i%10;
+			card->_type = kind == 1?Card::Tradable:kind == 2?Card::NonTradable:kind == 3?Card::Minor:Card::Normal;
+			g._cards.insert(card);
+		}
+	}
+	for(int i = 0; i < numPowers; ++i)
+	{
+		PowerP power(new Power);
+		power->_name = "Power" + boost::lexical_cast<std::string>(i);
+		power->_ast = i;
+		g._powers.insert(std::make_pair(power, PlayerP()));
+	}
+
+	double start = seconds();
+	g.Reindex();
+	double elapsed = seconds()-start;
+	std::cout << "Reindex\t" << g._cards.size() << " cards, " << numPowers << " powers\t" << elapsed << "s" << std::endl;
+
+	const char *rulesets[] = {"AdvCiv", "CivProject30"};
+	BOOST_FOREACH(auto ruleset, rulesets)
+	{
+		g._vars["ruleset"] = ruleset;
+		g.ResolveRules();
+		start = seconds();
+		for(int i = 0; i < rounds; ++i)
+		{
+			g._decks.clear();
+			CreateDecks(g);
+		}
+		elapsed = seconds()-start;
+		std::cout << "CreateDecks " << ruleset << "\t" << rounds << " x " << g._cards.size() << " cards\t"
+			<< elapsed << "s\t" << g._cards.size()*double(rounds)/elapsed << " cards/s" << std::endl;
+	}
+	return ErrNone;
+}
+
+// Reshuffles ten discard piles of the given size serially and on the pool
+int benchReshuffle(int cardsPerDeck, int rounds)
+{
+	Game g("", true);
+	g._decks.resize(10);
+	g._discards.resize(10);
+	Hands piles(10);
+	for(int deck = 0; deck < 10; ++deck)
+	{
+		for(int i = 0; i < cardsPerDeck; ++i)
+		{
+			CardP card(new Card);
+			card->_name = "Card" + boost::lexical_cast<std::string>(i);
+			card->_deck = deck;
+			card->_maxCount = 1;
+			card->_supplement = false;
+			card->_type = (i%10)?Card::Normal:Card::NonTradable;
+			piles[deck].insert(card);
+		}
+	}
+
+	ThreadPool serial(1);
+	ThreadPool *pools[] = {&serial, &ThreadPool::Shared()};
+	BOOST_FOREACH(auto pool, pools)
+	{
+		double start = seconds();
+		for(int i = 0; i < rounds; ++i)
+		{
+			for(int deck = 0; deck < 10; ++deck)
+			{
+				g._decks[deck].clear();
+				g._discards[deck] = piles[deck];
+			}
+			ReshuffleDecks(g, *pool);
+		}
+		double elapsed = seconds()-start;
+		std::cout << "ReshuffleDecks " << pool->Threads() << " threads\t" << rounds << " x 10 x " << cardsPerDeck << " cards\t"
+			<< elapsed << "s\t" << 10*cardsPerDeck*double(rounds)/elapsed << " cards/s" << std::endl;
+	}
+	return ErrNone;
+}
+
+// Scores every power's hand and portfolio by walking each hand, from the
+// running totals and from a ScoreTable
+int benchScore(int cardsPerDeck, int numPowers, int rounds)
+{
+	Game g("", true);
+	g._vars["ruleset"] = "AdvCiv";
+	g.ResolveRules();
+	for(int deck = 1; deck < 10; ++deck)
+	{
+		for(int i = 0; i < cardsPerDeck; ++i)
+		{
+			CardP card(new Card);
+			card->_name = "Card" + boost::lexical_cast<std::string>(deck) + "_" + boost::lexical_cast<std::string>(i);
+			card->_deck = deck;
+			card->_maxCount = 8;
+			card->_supplement = false;
+			card->_type = (i%10)?Card::Normal:Card::NonTradable;
+			g._cards.insert(card);
+		}
+	}
+	for(int i = 0; i < 24; ++i)
+	{
+		CivCardP card(new CivCard);
+		card->_name = "Civ" + boost::lexical_cast<std::string>(i);
+		card->_cost = 50 + 10*i;
+		card->_evil = false;
+		g.AddCivCard(card);
+	}
+	for(int i = 0; i < numPowers; ++i)
+	{
+		PowerP power(new Power);
+		power->_name = "Power" + boost::lexical_cast<std::string>(i);
+		power->_ast = i;
+		g._powers.insert(std::make_pair(power, PlayerP()));
+	}
+	g.Reindex();
+
+	// Hands of a few sets each, portfolios of about half the civ cards
+	Rng rng(DeviceSeed());
+	BOOST_FOREACH(auto power, g._powerIds)
+	{
+		for(int i = 0; i < 20; ++i)
+			power->Add(g._cardIds[rng.Below(g._cardIds.size()/4)]);
+		BOOST_FOREACH(auto card, g._civcards)
+		{
+			if (rng.Below(2))
+				power->AddCivCard(card);
+		}
+	}
+
+	const Ruleset &rules = *g.Rules();
+	long check[3] = {0, 0, 0};
+	double start = seconds();
+	for(int i = 0; i < rounds; ++i)
+	{
+		BOOST_FOREACH(auto power, g._powerIds)
+		{
+			check[0] += ValueHand(power->_hand);
+			BOOST_FOREACH(auto card, power->_civCards._cards)
+				check[0] += rules.CivPoints(card->_cost);
+		}
+	}
+	double elapsed = seconds()-start;
+	std::cout << "Per hand\t" << rounds << " x " << numPowers << " powers\t"
+		<< elapsed << "s\t" << numPowers*double(rounds)/elapsed << " powers/s" << std::endl;
+
+	start = seconds();
+	for(int i = 0; i < rounds; ++i)
+	{
+		BOOST_FOREACH(auto power, g._powerIds)
+			check[1] += power->Score()._handValue + power->Score()._civPoints[rules.Scoring()];
+	}
+	elapsed = seconds()-start;
+	std::cout << "Running totals\t" << rounds << " x " << numPowers << " powers\t"
+		<< elapsed << "s\t" << numPowers*double(rounds)/elapsed << " powers/s" << std::endl;
+
+	std::vector<int> values, points;
+	start = seconds();
+	for(int i = 0; i < rounds; ++i)
+	{
+		const ScoreTable table(g);
+		table.HandValues(values);
+		table.CivPoints(rules, points);
+		for(int p = 0; p < numPowers; ++p)
+			check[2] += values[p] + points[p];
+	}
+	elapsed = seconds()-start;
+	std::cout << "ScoreTable\t" << rounds << " x " << numPowers << " powers\t"
+		<< elapsed << "s\t" << numPowers*double(rounds)/elapsed << " powers/s" << std::endl;
+
+	const ScoreTable table(g);
+	start = seconds();
+	for(int i = 0; i < rounds; ++i)
+	{
+		table.HandValues(values);
+		table.CivPoints(rules, points);
+	}
+	elapsed = seconds()-start;
+	std::cout << "ScoreTable kernels\t" << rounds << " x " << numPowers << " powers\t"
+		<< elapsed << "s\t" << numPowers*double(rounds)/elapsed << " powers/s" << std::endl;
+
+	if (check[0] != check[1] || check[0] != check[2])
+	{
+		std::cerr << "Scores differ: " << check[0] << ' ' << check[1] << ' ' << check[2] << std::endl;
+		return ErrUnableToParse;
+	}
+	return ErrNone;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+	{
+		std::cerr << argv[0] << " shuffle [#Cards] [#Rounds]" << std::endl;
+		std::cerr << argv[0] << " reshuffle [#CardsPerDeck] [#Rounds]" << std::endl;
+		std::cerr << argv[0] << " create [#CardsPerDeck] [#Powers] [#Rounds]" << std::endl;
+		std::cerr << argv[0] << " score [#CardsPerDeck] [#Powers] [#Rounds]" << std::endl;
+		return ErrUnableToParse;
+	}
+
+	const std::string mode(argv[1]);
+	if (mode == "shuffle")
+	{
+		int numCards = argc > 2?boost::lexical_cast<int>(argv[2]):60;
+		int rounds = argc > 3?boost::lexical_cast<int>(argv[3]):10000;
+		return benchShuffle(numCards, rounds);
+	}
+	if (mode == "reshuffle")
+	{
+		int cardsPerDeck = argc > 2?boost::lexical_cast<int>(argv[2]):50;
+		int rounds = argc > 3?boost::lexical_cast<int>(argv[3]):1000;
+		return benchReshuffle(cardsPerDeck, rounds);
+	}
+	if (mode == "create")
+	{
+		int cardsPerDeck = argc > 2?boost::lexical_cast<int>(argv[2]):10000;
+		int numPowers = argc > 3?boost::lexical_cast<int>(argv[3]):1000;
+		int rounds = argc > 4?boost::lexical_cast<int>(argv[4]):10;
+		return benchCreate(cardsPerDeck, numPowers, rounds);
+	}
+
+	if (mode == "score")
+	{
+		int cardsPerDeck = argc > 2?boost::lexical_cast<int>(argv[2]):10;
+		int numPowers = argc > 3?boost::lexical_cast<int>(argv[3]):10000;
+		int rounds = argc > 4?boost::lexical_cast<int>(argv[4]):100;
+		return benchScore(cardsPerDeck, numPowers, rounds);
+	}
+
+	std::cerr << "Unknown benchmark " << mode << std::endl;
+	return ErrUnableToParse;
+}
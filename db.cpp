@@ -1,4 +1,6 @@
 #include "db.h"
+#include "rng.h"
+#include "rules.h"
 
 #include <boost/archive/xml_iarchive.hpp>
 #include <boost/archive/xml_oarchive.hpp>
@@ -12,7 +14,10 @@
 
 #include <boost/foreach.hpp>
 
+#include <cstdio>
+#include <cstdlib>
 #include <fstream>
+#include <iostream>
 
 
 namespace boost { namespace serialization {
@@ -80,6 +85,22 @@ namespace boost { namespace serialization {
 		ar & make_nvp("email",p._email);
 	}
 
+	template <class Archive>
+	void serialize(Archive &ar, Offer &o, unsigned int)
+	{
+		ar & make_nvp("id",o._id);
+		ar & make_nvp("power",o._power);
+		ar & make_nvp("gives",o._gives);
+		ar & make_nvp("wants",o._wants);
+	}
+
+	template <class Archive>
+	void serialize(Archive &ar, OfferBook &b, unsigned int)
+	{
+		ar & make_nvp("offers",b._offers);
+		ar & make_nvp("nextId",b._nextId);
+	}
+
 	template <class Archive>
 	void serialize(Archive &ar, Game &g, unsigned int version)
 	{
@@ -97,12 +118,14 @@ namespace boost { namespace serialization {
 			ar & make_nvp("variables", g._vars);
 		if (version >= 3)
 			ar & make_nvp("civcards", g._civcards);
+		if (version >= 4)
+			ar & make_nvp("offers", g._offers);
 	}	
 }}
 
 BOOST_CLASS_VERSION(Power, 3)
 BOOST_CLASS_VERSION(Card, 2)
-BOOST_CLASS_VERSION(Game, 3)
+BOOST_CLASS_VERSION(Game, 4)
 
 bool CardCompare::operator()(const CardP &lhs, const CardP &rhs) const
 {
@@ -159,10 +182,109 @@ void Game::Save(const std::string &filename)
 {
 	if (_abandon)
 		return;
-	std::ofstream out(filename.c_str(), std::ios::binary);
-	boost::archive::xml_oarchive oa(out);
-	oa << boost::serialization::make_nvp("Game",*this);
+	Write(filename);
+}
+
+// Writes to a temporary file first so a failed write leaves the old game
+bool Game::Write(const std::string &filename)
+{
+	const std::string temp = filename + ".tmp";
+	std::ofstream out(temp.c_str(), std::ios::binary);
+	try
+	{
+		// The archive writes its closing tags when it goes out of scope
+		boost::archive::xml_oarchive oa(out);
+		oa << boost::serialization::make_nvp("Game",*this);
+	}
+	catch(const std::exception &e)
+	{
+		std::cerr << "Unable to save " << filename << ": " << e.what() << std::endl;
+		std::remove(temp.c_str());
+		return false;
+	}
+	out.close();
+	if (!out)
+	{
+		std::cerr << "Unable to write " << temp << std::endl;
+		std::remove(temp.c_str());
+		return false;
+	}
+	if (std::rename(temp.c_str(), filename.c_str()) != 0)
+	{
+		std::cerr << "Unable to rename " << temp << " to " << filename << std::endl;
+		return false;
+	}
 	std::cerr << "Saved " << filename << std::endl;
+	return true;
+}
+
+boost::shared_ptr<Game> Game::Snapshot() const
+{
+	boost::shared_ptr<Game> copy(new Game);
+	copy->_fn = _fn;
+	copy->_cards = _cards;
+	copy->_civcards = _civcards;
+	copy->_decks = _decks;
+	copy->_discards = _discards;
+	copy->_queue = _queue;
+	copy->_vars = _vars;
+	copy->_rules = _rules;
+
+	// Cards, civ cards and players are never changed in place, powers are
+	std::map<PowerP, PowerP> copies;
+	BOOST_FOREACH(auto i, _powers)
+	{
+		PowerP power(new Power(*i.first));
+		power->Track(NULL, NULL, i.first->Id());
+		copy->_powers[power] = i.second;
+		copies[i.first] = power;
+	}
+	// Offers have to point at the copies or they would be written twice
+	copy->_offers._nextId = _offers._nextId;
+	BOOST_FOREACH(auto &i, _offers._offers)
+	{
+		OfferP offer(new Offer(*i.second));
+		offer->_power = copies[offer->_power];
+		copy->_offers._offers[offer->_id] = offer;
+	}
+	return copy;
+}
+
+boost::shared_ptr<Game> Game::Fork() const
+{
+	boost::shared_ptr<Game> fork = Snapshot();
+	fork->Reindex();
+	return fork;
+}
+
+void Game::Promote(Game &original)
+{
+	original.WaitForSave();
+	_fn = original._fn;
+	_abandon = original._abandon;
+	original.Abandon();
+}
+
+void Game::Save()
+{
+	if (_abandon)
+		return;
+	WaitForSave();
+	boost::shared_ptr<Game> snapshot = Snapshot();
+	_saved = false;
+	// Only read after the join
+	bool &saved = _saved;
+	_saver = boost::thread([snapshot, &saved]()
+	{
+		saved = snapshot->Write(snapshot->_fn);
+	});
+}
+
+bool Game::WaitForSave()
+{
+	if (_saver.joinable())
+		_saver.join();
+	return _saved;
 }
 
 void Game::Load(const std::string &filename)
@@ -174,10 +296,356 @@ void Game::Load(const std::string &filename)
 	}
 	boost::archive::xml_iarchive ia(in);
 	ia >> boost::serialization::make_nvp("Game",*this);
+	Reindex();
 	std::cerr << "Loaded " << filename << std::endl;
 }
 
-Power::Power():_ast(0)
+void NameIndex::Build(const Game &g)
+{
+	_powers.Clear();
+	_cards.Clear();
+	_civcards.Clear();
+	_groups.Clear();
+	_vars.Clear();
+
+	BOOST_FOREACH(auto i, g._powers)
+		_powers.Insert(i.first->_name, i.first);
+	BOOST_FOREACH(auto i, g._cards)
+		_cards.Insert(i->_name, i);
+	BOOST_FOREACH(auto i, g._civcards)
+		_civcards.Insert(i->_name, i);
+	for(int i = 0; i < CivCard::GroupSize; ++i)
+		_groups.Insert(CivCard::_groupList[i], i);
+	BOOST_FOREACH(auto i, g._vars)
+		_vars.Insert(i.first, i.first);
+}
+
+const CatalogIndex::Bucket CatalogIndex::_empty;
+
+const CatalogIndex::Bucket &CatalogIndex::Get(int deck, Card::Type type) const
+{
+	if (deck < 0 || deck >= _buckets.size() || -type < 0 || -type >= Types)
+		return _empty;
+	return _buckets[deck][-type];
+}
+
+void CatalogIndex::Insert(CardP card)
+{
+	if (card->_deck < 0 || -card->_type < 0 || -card->_type >= Types)
+		return;
+	if (card->_deck >= _buckets.size())
+		_buckets.resize(card->_deck+1, std::vector<Bucket>(Types));
+
+	Bucket &bucket = _buckets[card->_deck][-card->_type];
+	bucket.insert(std::upper_bound(bucket.begin(), bucket.end(), card, CardCompare()), card);
+}
+
+void CatalogIndex::Build(const Cards &cards)
+{
+	_buckets.clear();
+	BOOST_FOREACH(auto card, cards)
+		Insert(card);
+}
+
+void Game::Reindex()
+{
+	_cardIds.clear();
+	BOOST_FOREACH(auto card, _cards)
+	{
+		card->_id = _cardIds.size();
+		_cardIds.push_back(card);
+	}
+	_powerIds.clear();
+	BOOST_FOREACH(auto power, _powers)
+	{
+		power.first->Track(&_ledger, &_undo, _powerIds.size());
+		_powerIds.push_back(power.first);
+		power.first->Reindex();
+	}
+	_names.Build(*this);
+	_catalog.Build(_cards);
+	Recount();
+	ResolveRules();
+	_offers.Reindex();
+	_undo.Forget();
+}
+
+void Game::ResolveRules()
+{
+	auto rules = _vars.find("ruleset");
+	_rules = rules == _vars.end()?NULL:FindRuleset(rules->second);
+}
+
+void Game::Count(CardLedger &ledger) const
+{
+	ledger.Clear();
+	BOOST_FOREACH(auto card, _cardIds)
+		ledger.Register(card);
+	for(int i = 0; i < _decks.size(); ++i)
+	{
+		BOOST_FOREACH(auto card, _decks[i])
+			ledger.Add(card, CardLedger::Location(CardLedger::InDeck, i));
+	}
+	for(int i = 0; i < _discards.size(); ++i)
+	{
+		BOOST_FOREACH(auto card, _discards[i])
+			ledger.Add(card, CardLedger::Location(CardLedger::InDiscard, i));
+	}
+	BOOST_FOREACH(auto power, _powers)
+	{
+		BOOST_FOREACH(auto card, power.first->_hand)
+			ledger.Add(card, CardLedger::Location(CardLedger::InHand, power.first->Id()));
+		BOOST_FOREACH(auto card, power.first->_staging)
+			ledger.Add(card, CardLedger::Location(CardLedger::InStaging, power.first->Id()));
+	}
+}
+
+void Game::AddPower(PowerP power)
+{
+	if (_powers.insert(std::make_pair(power, PlayerP())).second)
+	{
+		power->Track(&_ledger, &_undo, _powerIds.size());
+		_powerIds.push_back(power);
+		_undo.Forget();
+		_names._powers.Insert(power->_name, power);
+		BOOST_FOREACH(auto card, power->_hand)
+			_ledger.Add(card, CardLedger::Location(CardLedger::InHand, power->Id()));
+		BOOST_FOREACH(auto card, power->_staging)
+			_ledger.Add(card, CardLedger::Location(CardLedger::InStaging, power->Id()));
+	}
+}
+
+void Game::AddCard(CardP card)
+{
+	if (_cards.insert(card).second)
+	{
+		card->_id = _cardIds.size();
+		_cardIds.push_back(card);
+		_names._cards.Insert(card->_name, card);
+		_catalog.Insert(card);
+		_ledger.Register(card);
+		_undo.Forget();
+	}
+}
+
+int OfferBook::Post(PowerP power, const Hand &gives, const Hand &wants)
+{
+	OfferP offer(new Offer);
+	offer->_id = _nextId++;
+	offer->_power = power;
+	offer->_gives = gives;
+	offer->_wants = wants;
+	_offers[offer->_id] = offer;
+	Index(offer, true);
+	return offer->_id;
+}
+
+bool OfferBook::Withdraw(int id)
+{
+	auto offer = _offers.find(id);
+	if (offer == _offers.end())
+		return false;
+	Index(offer->second, false);
+	_offers.erase(offer);
+	return true;
+}
+
+void OfferBook::Restore(const OfferP &offer)
+{
+	if (!_offers.insert(std::make_pair(offer->_id, offer)).second)
+		return;
+	Index(offer, true);
+}
+
+OfferP OfferBook::Find(int id) const
+{
+	auto offer = _offers.find(id);
+	return offer == _offers.end()?OfferP():offer->second;
+}
+
+void OfferBook::Givers(const Hand &cards, std::vector<OfferP> &found) const
+{
+	if (cards.empty())
+	{
+		BOOST_FOREACH(auto &offer, _offers)
+			found.push_back(offer.second);
+		return;
+	}
+
+	// Only offers giving the card the fewest offers give can give them all
+	const std::vector<int> *fewest = NULL;
+	BOOST_FOREACH(auto card, cards)
+	{
+		if (card->_id < 0 || card->_id >= _givers.size())
+			return;
+		if (!fewest || _givers[card->_id].size() < fewest->size())
+			fewest = &_givers[card->_id];
+	}
+	BOOST_FOREACH(auto id, *fewest)
+	{
+		const OfferP &offer = _offers.find(id)->second;
+		if (std::includes(offer->_gives.begin(), offer->_gives.end(), cards.begin(), cards.end(), CardCompare()))
+			found.push_back(offer);
+	}
+}
+
+void OfferBook::Index(const OfferP &offer, bool add)
+{
+	for(auto i = offer->_gives.begin(); i != offer->_gives.end(); i = offer->_gives.upper_bound(*i))
+	{
+		const int id = (*i)->_id;
+		if (id < 0)
+			continue;
+		if (id >= _givers.size())
+			_givers.resize(id+1);
+		std::vector<int> &givers = _givers[id];
+		if (add)
+			givers.insert(std::upper_bound(givers.begin(), givers.end(), offer->_id), offer->_id);
+		else
+			givers.erase(std::lower_bound(givers.begin(), givers.end(), offer->_id));
+	}
+}
+
+void OfferBook::Reindex()
+{
+	_givers.clear();
+	BOOST_FOREACH(auto &offer, _offers)
+		Index(offer.second, true);
+}
+
+void Game::AddCivCard(CivCardP card)
+{
+	if (_civcards.insert(card).second)
+		_names._civcards.Insert(card->_name, card);
+}
+
+const CardLedger::Places CardLedger::_none;
+
+void CardLedger::Grow(const CardP &card)
+{
+	if (card->_id < _places.size())
+		return;
+	_places.resize(card->_id+1);
+	_totals.resize(card->_id+1);
+	_imbalance += std::abs(card->_maxCount);
+}
+
+void CardLedger::Register(const CardP &card)
+{
+	if (card->_id >= 0)
+		Grow(card);
+}
+
+void CardLedger::Add(const CardP &card, Location where, int n)
+{
+	if (card->_id < 0)
+		return;
+	Grow(card);
+
+	if (where._kind == InHand && card->_type != Card::Normal)
+	{
+		const auto key = std::make_pair(card, where._index);
+		if (!(_calamities[key] += n))
+			_calamities.erase(key);
+	}
+
+	Places &places = _places[card->_id];
+	int &total = _totals[card->_id];
+	_imbalance += std::abs(total+n-card->_maxCount) - std::abs(total-card->_maxCount);
+	total += n;
+	for(auto i = places.begin(); i != places.end(); ++i)
+	{
+		if (i->first == where)
+		{
+			i->second += n;
+			if (!i->second)
+			{
+				*i = places.back();
+				places.pop_back();
+			}
+			return;
+		}
+	}
+	places.push_back(std::make_pair(where, n));
+}
+
+void CardLedger::Move(const CardP &card, Location from, Location to, int n)
+{
+	Add(card, from, -n);
+	Add(card, to, n);
+}
+
+const CardLedger::Places &CardLedger::Find(const CardP &card) const
+{
+	if (card->_id < 0 || card->_id >= _places.size())
+		return _none;
+	return _places[card->_id];
+}
+
+int CardLedger::Total(const CardP &card) const
+{
+	if (card->_id < 0 || card->_id >= _totals.size())
+		return 0;
+	return _totals[card->_id];
+}
+
+void CardLedger::Clear()
+{
+	_places.clear();
+	_totals.clear();
+	_imbalance = 0;
+	_calamities.clear();
+}
+
+bool CardLedger::CalamityOrder::operator()(const std::pair<CardP, int> &l, const std::pair<CardP, int> &r) const
+{
+	CardCompare cards;
+	if (cards(l.first, r.first))
+		return true;
+	if (cards(r.first, l.first))
+		return false;
+	return l.second < r.second;
+}
+
+Scoreboard::Scoreboard()
+{
+	Clear();
+}
+
+void Scoreboard::Clear()
+{
+	_handValue = 0;
+	std::fill(_civPoints, _civPoints+Scorings, 0);
+	_evil = 0;
+	_calamities = 0;
+	_minorCalamities = 0;
+}
+
+void Scoreboard::AddCard(const CardP &card, int count, int n)
+{
+	if (card->_type == Card::Normal)
+	{
+		// Value grows with the square of the copies held
+		const int after = count+n;
+		_handValue += (after*after - count*count)*card->_deck;
+		return;
+	}
+	_calamities += n;
+	if (card->_type == Card::Minor)
+		_minorCalamities += n;
+}
+
+void Scoreboard::AddCivCard(const CivCardP &card, int n)
+{
+	const int cost = card->_cost;
+	_civPoints[AdvCivRules::Scoring] += n*AdvCivRules::CivPoints(cost);
+	_civPoints[CivProject21Rules::Scoring] += n*CivProject21Rules::CivPoints(cost);
+	_civPoints[CivProject30Rules::Scoring] += n*CivProject30Rules::CivPoints(cost);
+	if (card->_evil)
+		_evil += n;
+}
+
+Power::Power():_ast(0),_ledger(NULL),_undo(NULL),_id(-1)
 {}
 
 
@@ -192,11 +660,203 @@ bool PowerCompare::operator()(const PowerP &lhs, const PowerP &rhs) const
 	return lhs->_name < rhs->_name;
 }
 
+CardCounts::CardCounts():_total(0)
+{}
+
+void CardCounts::Clear()
+{
+	_tree.clear();
+	_counts.clear();
+	_cards.clear();
+	_total = 0;
+}
+
+// Sizes stay powers of two so Find can walk down the tree bit by bit
+void CardCounts::Grow(int id)
+{
+	int size = _tree.size()?_tree.size():16;
+	while(size <= id)
+		size *= 2;
+	_counts.resize(size, 0);
+	_cards.resize(size);
+	_tree.assign(size, 0);
+	for(int i = 0; i < size; ++i)
+	{
+		_tree[i] += _counts[i];
+		const int parent = i | (i+1);
+		if (parent < size)
+			_tree[parent] += _tree[i];
+	}
+}
+
+void CardCounts::Add(CardP card, int n)
+{
+	const int id = card->_id;
+	if (id >= int(_tree.size()))
+		Grow(id);
+	_cards[id] = card;
+	_counts[id] += n;
+	_total += n;
+	for(int i = id; i < int(_tree.size()); i |= i+1)
+		_tree[i] += n;
+}
+
+int CardCounts::Count(const CardP &card) const
+{
+	const int id = card->_id;
+	return (id >= 0 && id < int(_counts.size()))?_counts[id]:0;
+}
+
+void CardCounts::CopyTo(int *counts, int n) const
+{
+	const int held = std::min<int>(n, _counts.size());
+	std::copy(_counts.begin(), _counts.begin()+held, counts);
+	std::fill(counts+held, counts+n, 0);
+}
+
+CardP CardCounts::Find(int index) const
+{
+	if (index < 0 || index >= _total)
+		return CardP();
+	int pos = 0;
+	for(int step = _tree.size(); step; step >>= 1)
+	{
+		const int next = pos + step;
+		if (next <= int(_tree.size()) && _tree[next-1] <= index)
+		{
+			pos = next;
+			index -= _tree[next-1];
+		}
+	}
+	return _cards[pos];
+}
+
+void Power::Track(CardLedger *ledger, UndoLog *undo, int id)
+{
+	_ledger = ledger;
+	_undo = undo;
+	_id = id;
+}
+
+void Power::Record(const CardP &card, CardLedger::Kind kind, int n)
+{
+	if (_ledger)
+		_ledger->Add(card, CardLedger::Location(kind, _id), n);
+	if (_undo)
+		_undo->Cards(CardLedger::Location(kind, _id), card, n);
+}
+
+void Power::Adjust(const CardP &card, CardLedger::Kind kind, int n)
+{
+	Hand &cards = kind == CardLedger::InStaging?_staging:_hand;
+	if (kind == CardLedger::InHand)
+	{
+		_score.AddCard(card, _counts.Count(card), n);
+		_counts.Add(card, n);
+	}
+	for(int i = 0; i < n; ++i)
+		cards.insert(card);
+	for(int i = 0; i < -n; ++i)
+		cards.erase(cards.find(card));
+	Record(card, kind, n);
+}
+
+void Power::Add(CardP card)
+{
+	_score.AddCard(card, _counts.Count(card), 1);
+	_hand.insert(card);
+	_counts.Add(card, 1);
+	Record(card, CardLedger::InHand, 1);
+}
+
+void Power::Add(const Hand &cards)
+{
+	BOOST_FOREACH(auto card, cards)
+		Add(card);
+}
+
+bool Power::Remove(const Hand &cards)
+{
+	if (!Has(cards))
+		return false;
+	BOOST_FOREACH(auto card, cards)
+	{
+		_score.AddCard(card, _counts.Count(card), -1);
+		_hand.erase(_hand.find(card));
+		_counts.Add(card, -1);
+		Record(card, CardLedger::InHand, -1);
+	}
+	return true;
+}
+
+bool Power::Stage(const Hand &cards)
+{
+	if (!Remove(cards))
+		return false;
+	_staging.insert(cards.begin(), cards.end());
+	BOOST_FOREACH(auto card, cards)
+		Record(card, CardLedger::InStaging, 1);
+	return true;
+}
+
+void Power::Exchange(Power &other)
+{
+	BOOST_FOREACH(auto card, _staging)
+	{
+		Record(card, CardLedger::InStaging, -1);
+		other.Record(card, CardLedger::InStaging, 1);
+	}
+	BOOST_FOREACH(auto card, other._staging)
+	{
+		other.Record(card, CardLedger::InStaging, -1);
+		Record(card, CardLedger::InStaging, 1);
+	}
+	std::swap(_staging, other._staging);
+}
+
+CardP Power::RandomCard(Rng &rng) const
+{
+	if (!_counts.Size())
+		return CardP();
+	return _counts.Find(rng.Below(_counts.Size()));
+}
+
+void Power::Reindex()
+{
+	_counts.Clear();
+	_score.Clear();
+	BOOST_FOREACH(auto card, _hand)
+	{
+		_score.AddCard(card, _counts.Count(card), 1);
+		_counts.Add(card, 1);
+	}
+	BOOST_FOREACH(auto card, _civCards._cards)
+		_score.AddCivCard(card);
+}
+
+void Power::AddCivCard(CivCardP card)
+{
+	if (!_civCards._cards.insert(card).second)
+		return;
+	_score.AddCivCard(card);
+	if (_undo)
+		_undo->CivCard(_id, card, 1);
+}
+
+void Power::RemoveCivCard(CivCardP card)
+{
+	if (!_civCards._cards.erase(card))
+		return;
+	_score.AddCivCard(card, -1);
+	if (_undo)
+		_undo->CivCard(_id, card, -1);
+}
+
 bool Power::Has(const Hand &cards) const
 {
-	BOOST_FOREACH(auto i, _hand)
+	for(auto i = cards.begin(); i != cards.end(); i = cards.upper_bound(*i))
 	{
-		if (cards.count(i) > _hand.count(i))
+		if (int(cards.count(*i)) > _counts.Count(*i))
 			return false;
 	}
 	
@@ -220,7 +880,9 @@ bool Power::Has(const CivCards &cards) const
 
 void Power::Merge()
 {
-	_hand.insert(_staging.begin(), _staging.end());
+	BOOST_FOREACH(auto card, _staging)
+		Record(card, CardLedger::InStaging, -1);
+	Add(_staging);
 	_staging.clear();
 }
 
@@ -292,8 +954,3 @@ int CivPortfolio::Cost(CivCardP card)
 	return cost;
 }
 
-int CivRand(int n)
-{
-	static boost::random_device _dev;
-	return int(_dev()%n);
-}
@@ -1,8 +1,6 @@
 #ifndef DB_H__
 #define DB_H__
 
-#include <boost/nondet_random.hpp>
-
 #include <boost/algorithm/string.hpp>
 
 #include <string>
@@ -12,6 +10,9 @@
 #include <map>
 #include <set>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "trie.h"
 
 class Card
 {
@@ -29,6 +30,9 @@ class Card
 	bool _supplement;
 	Type _type;
 	std::string _image;
+	int _id; // Position in Game::_cardIds, not saved
+
+	Card():_id(-1){}
 };
 
 typedef boost::shared_ptr<Card> CardP;
@@ -97,11 +101,111 @@ class CivPortfolio
 		}
 };
 
+class Rng;
+
+// Copies of each card by card id, kept as a Fenwick tree so the n-th copy
+// (and so a uniformly random one) is found in O(log n)
+class CardCounts
+{
+	public:
+		CardCounts();
+		void Add(CardP card, int n);
+		int Count(const CardP &card) const;
+		// Copies of cards 0 to n-1 into counts
+		void CopyTo(int *counts, int n) const;
+		int Size() const {return _total;}
+		CardP Find(int index) const;
+		void Clear();
+
+	private:
+		void Grow(int id);
+
+		std::vector<int> _tree;
+		std::vector<int> _counts;
+		std::vector<CardP> _cards;
+		int _total;
+};
+
+// Where the copies of every card are, by card id.  Every change to a deck,
+// discard pile, hand or staging area is recorded here so finding a card or
+// checking that none were lost or duplicated doesn't scan the game.
+class CardLedger
+{
+	public:
+		enum Kind {InDeck, InDiscard, InHand, InStaging};
+
+		// Deck number for decks and discard piles, power id otherwise
+		struct Location
+		{
+			Kind _kind;
+			int _index;
+
+			Location(Kind kind, int index):_kind(kind),_index(index){}
+			bool operator==(const Location &o) const {return _kind == o._kind && _index == o._index;}
+		};
+		typedef std::vector<std::pair<Location, int> > Places;
+		// Copies of each calamity in each power's hand, in resolution order
+		// (Cards order, then power id)
+		struct CalamityOrder
+		{
+			bool operator()(const std::pair<CardP, int> &l, const std::pair<CardP, int> &r) const;
+		};
+		typedef std::map<std::pair<CardP, int>, int, CalamityOrder> Calamities;
+
+		// Notes a card that should have _maxCount copies somewhere
+		void Register(const CardP &card);
+		void Add(const CardP &card, Location where, int n = 1);
+		void Move(const CardP &card, Location from, Location to, int n = 1);
+		// Every location holding a copy of the card with how many it holds
+		const Places &Find(const CardP &card) const;
+		int Total(const CardP &card) const;
+		// Sum over every card of how far its total is from _maxCount, kept
+		// as cards move so checking it after a command costs nothing
+		long Imbalance() const {return _imbalance;}
+		const Calamities &HeldCalamities() const {return _calamities;}
+		void Clear();
+
+		CardLedger():_imbalance(0){}
+
+	private:
+		void Grow(const CardP &card);
+
+		static const Places _none;
+		std::vector<Places> _places;
+		std::vector<int> _totals;
+		long _imbalance;
+		Calamities _calamities;
+};
+
+// Running totals for one power, kept up to date by every hand and portfolio
+// change so summaries never walk the cards
+class Scoreboard
+{
+	public:
+		// Civ card points under each ruleset's scoring
+		enum Scoring {AdvCivScoring, CivProject21Scoring, CivProject30Scoring, Scorings};
+
+		int _handValue; // Same as ValueHand(_hand)
+		int _civPoints[Scorings];
+		int _evil;
+		int _calamities; // Every card that isn't Normal, minor ones included
+		int _minorCalamities;
+
+		Scoreboard();
+		// count is how many copies the hand held before adding n of them
+		void AddCard(const CardP &card, int count, int n);
+		// n is 1 for a card gained, -1 for one lost
+		void AddCivCard(const CivCardP &card, int n = 1);
+		void Clear();
+};
+
+class UndoLog;
+
 class Power
 {
 	public:
 	std::string _name;  
-	Hand _hand;
+	Hand _hand; // Change through Add/Remove/Stage/Merge so _counts stays right
 	Hand _staging;
 	CivPortfolio _civCards;
 	int _ast;
@@ -110,11 +214,38 @@ class Power
 	
 	public:
 		Power();
+		void Add(CardP card);
+		void Add(const Hand &cards);
+		bool Remove(const Hand &cards);
 		void Merge();
  		bool Has(const Hand &cards) const;
 		bool Has(const CivCardP card) const;
 		bool Has(const CivCards &cards) const;
 		bool Stage(const Hand &cards);
+		void AddCivCard(CivCardP card);
+		void RemoveCivCard(CivCardP card);
+		// Puts n copies of card straight into the hand or staging, or takes
+		// them out when n is negative, for undo
+		void Adjust(const CardP &card, CardLedger::Kind kind, int n);
+		const Scoreboard &Score() const {return _score;}
+		const CardCounts &Counts() const {return _counts;}
+		// Swaps what the two powers have staged
+		void Exchange(Power &other);
+		CardP RandomCard(Rng &rng) const;
+		void Reindex();
+		// Hand, staging and portfolio changes are recorded in ledger and undo
+		// under id, NULL stops it
+		void Track(CardLedger *ledger, UndoLog *undo, int id);
+		int Id() const {return _id;}
+
+	private:
+		void Record(const CardP &card, CardLedger::Kind kind, int n);
+
+		CardCounts _counts;
+		Scoreboard _score;
+		CardLedger *_ledger;
+		UndoLog *_undo;
+		int _id;
 };
 
 typedef boost::shared_ptr<Power> PowerP;
@@ -138,6 +269,145 @@ typedef boost::shared_ptr<Player> PlayerP;
 typedef std::map<PowerP, PlayerP, PowerCompare> Powers;
 typedef std::vector<Deck> Decks;
 
+// A power's standing offer to hand over _gives to whoever hands it _wants
+class Offer
+{
+	public:
+		int _id;
+		PowerP _power;
+		Hand _gives;
+		Hand _wants;
+};
+typedef boost::shared_ptr<Offer> OfferP;
+
+// Posted offers by id, with the offers giving each card indexed by card id
+// so finding who can meet a want doesn't look at every offer
+class OfferBook
+{
+	public:
+		typedef std::map<int, OfferP> Offers;
+
+		OfferBook():_nextId(1){}
+		int Post(PowerP power, const Hand &gives, const Hand &wants);
+		bool Withdraw(int id);
+		OfferP Find(int id) const;
+		// Puts a withdrawn offer back under its id
+		void Restore(const OfferP &offer);
+		// Offers giving at least every card of cards
+		void Givers(const Hand &cards, std::vector<OfferP> &found) const;
+		void Reindex();
+
+		// Saved, change through Post/Withdraw so the index stays right
+		Offers _offers;
+		int _nextId;
+
+	private:
+		void Index(const OfferP &offer, bool add);
+
+		std::vector<std::vector<int> > _givers; // Offer ids by card id
+};
+
+class Game;
+class Ruleset;
+
+// Inverse of every change commands make to the cards, portfolios, players,
+// variables and offers, grouped by command, so undoing one puts back just
+// what it changed however big the game is.  Undoing records the changes it
+// makes as the command to redo.  Not saved, a loaded game starts with none.
+class UndoLog
+{
+	public:
+		// Groups the changes until End under line
+		void Begin(const std::string &line);
+		void End();
+		// Drops every command, the catalog or powers changed under them
+		void Forget();
+		// False when there is nothing to undo or redo, line is the command
+		// undone or redone
+		bool Undo(Game &g, std::string &line);
+		bool Redo(Game &g, std::string &line);
+
+		// Called where the game changes.  n copies gained, lost when negative.
+		void Cards(CardLedger::Location where, const CardP &card, int n);
+		void DeckFront(int deck, const CardP &card, int n);
+		// n is 1 when cards were put on the bottom of the deck, -1 when taken off
+		void DeckEnd(int deck, const Deck &cards, int n);
+		void CivCard(int power, const CivCardP &card, int n);
+		void Credits(int power, int group, int n);
+		void Variable(const std::string &name, const std::string &before);
+		void Assign(int power, const PlayerP &before);
+		// n is 1 when offer was posted, -1 when withdrawn
+		void Post(const OfferP &offer, int n);
+
+	private:
+		enum Kind {CardsOp, DeckFrontOp, DeckEndOp, CivCardOp, CreditsOp, VariableOp, AssignOp, PostOp};
+		// _index is where an op's payload is in its group, or the group of
+		// credits
+		struct Op
+		{
+			Kind _kind;
+			int _where; // Power id or deck, or the CardLedger::Kind for cards
+			int _n;
+			int _index;
+			CardP _card;
+		};
+		struct Group
+		{
+			std::string _line;
+			std::vector<Op> _ops;
+			std::vector<Deck> _piles;
+			std::vector<CivCardP> _civCards;
+			std::vector<std::string> _names; // Variable name, value pairs
+			std::vector<PlayerP> _players;
+			std::vector<OfferP> _offers;
+		};
+		typedef boost::shared_ptr<Group> GroupP;
+		typedef std::deque<GroupP> Groups;
+
+		static const int MaxCommands = 100; // On each stack, oldest dropped first
+
+		Op &Add(Kind kind, int where, int n, int index = 0);
+		bool Reverse(Game &g, Groups &from, Groups &to, std::string &line);
+		void Reverse(Game &g, const Group &group, const Op &op);
+		static void Push(Groups &groups, const GroupP &group);
+
+		Groups _undo;
+		Groups _redo;
+		GroupP _current; // NULL outside a command
+};
+
+// Name lookups used by the shell's completion
+class NameIndex
+{
+	public:
+		PrefixTrie<PowerP> _powers;
+		PrefixTrie<CardP> _cards;
+		PrefixTrie<CivCardP> _civcards;
+		PrefixTrie<int> _groups;
+		PrefixTrie<std::string> _vars;
+
+		void Build(const Game &g);
+};
+
+// Catalog cards grouped by deck and type, each group in Cards order, so deck
+// creation and dump only touch the cards they deal with
+class CatalogIndex
+{
+	public:
+		typedef std::vector<CardP> Bucket;
+
+		const Bucket &Get(int deck, Card::Type type) const;
+		int Decks() const {return _buckets.size();}
+
+		void Insert(CardP card);
+		void Build(const Cards &cards);
+
+	private:
+		enum {Types = 4};
+		static const Bucket _empty;
+		std::vector<std::vector<Bucket> > _buckets; // [deck][-type]
+};
+
 class Game
 {
 	private:
@@ -151,8 +421,8 @@ class Game
 	typedef std::map<std::string, std::string, less> Variables;
 	
 	public:
-	Game(const std::string &f, bool abandon=false):_fn(f),_abandon(abandon){Load(_fn);}
-	~Game(){Save(_fn);}
+	Game(const std::string &f, bool abandon=false):_fn(f),_abandon(abandon),_saved(true),_rules(NULL){Load(_fn);}
+	~Game(){WaitForSave(); Save(_fn);}
 	
 	Powers _powers;
 	Decks _decks;
@@ -161,19 +431,55 @@ class Game
 	CivCards _civcards;
 	std::queue<std::string> _queue;
 	Variables _vars;
+	NameIndex _names; // Not saved, rebuilt on load
+	CatalogIndex _catalog; // Not saved, rebuilt on load
+	std::vector<CardP> _cardIds; // Not saved, rebuilt on load
+	std::vector<PowerP> _powerIds; // Not saved, rebuilt on load
+	CardLedger _ledger; // Not saved, rebuilt on load
+	OfferBook _offers;
+	UndoLog _undo; // Not saved
 	
+	void AddPower(PowerP power);
+	void AddCard(CardP card);
+	void AddCivCard(CivCardP card);
+	void Reindex();
+	// Counts every card in the decks, discards, hands and staging
+	void Count(CardLedger &ledger) const;
+	void Recount() {Count(_ledger);}
+	// Looks the "ruleset" variable up once, call after changing it
+	void ResolveRules();
+	// NULL for a ruleset the game doesn't know
+	const Ruleset *Rules() const {return _rules;}
+
 	Powers::iterator FindPower(const std::string &);
 	Powers::const_iterator FindPower(const std::string &) const;
 
 	CardP FindCard(const std::string &) const;
 	CivCardP FindCivCard(const std::string &) const;
 	void Abandon();
+
+	// Copies the state as it is now and writes it out on a worker thread
+	void Save();
+	// False if the last save failed, the game file is then unchanged
+	bool WaitForSave();
+	// Copy to try moves out on.  It shares the cards, civ cards and players
+	// with this game and is never saved.
+	boost::shared_ptr<Game> Fork() const;
+	// Makes this fork the game saved to original's file, original is abandoned
+	void Promote(Game &original);
 	
 	private:
+		Game():_abandon(true),_saved(true),_rules(NULL){}
+		boost::shared_ptr<Game> Snapshot() const;
+
 		std::string _fn;
 		bool _abandon; // We don't want this state saveable
+		boost::thread _saver;
+		bool _saved; // Result of the last Save(), written by _saver
+		const Ruleset *_rules;
 		void Load(const std::string &);
 		void Save(const std::string &);
+		bool Write(const std::string &);
 };
 
 int CivRand(int n);
@@ -1,12 +1,21 @@
 #include "dbUtils.h"
+#include "rng.h"
+#include "rules.h"
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <limits>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/foreach.hpp>
 
+bool Continuable(int error)
+{
+	return error < ErrQuit || error == ErrFork || error == ErrPromote || error == ErrDiscard;
+}
+
 int ValueHand(const Hand &hand)
 {
 	int value = 0;
@@ -24,6 +33,61 @@ int ValueHand(const Hand &hand)
 	return value;
 }
 
+bool ChoosePayment(const Hand &hand, int cost, Hand &payment)
+{
+	if (cost <= 0)
+		return true;
+
+	std::vector<std::pair<CardP, int> > sets;
+	CardP currentCard;
+	BOOST_FOREACH(auto i, hand)
+	{
+		if (currentCard == i)
+			continue;
+		currentCard = i;
+		if (currentCard->_type == Card::Normal)
+			sets.push_back(std::make_pair(currentCard, (int)hand.count(currentCard)));
+	}
+
+	// lost[i][v] is the least value the hand loses paying v with the first
+	// i sets, v capped at cost; took[i][v] the cards of set i-1 it took
+	const int none = std::numeric_limits<int>::max();
+	std::vector<std::vector<int> > lost(sets.size()+1, std::vector<int>(cost+1, none));
+	std::vector<std::vector<int> > took(sets.size()+1, std::vector<int>(cost+1, 0));
+	std::vector<std::vector<int> > from(sets.size()+1, std::vector<int>(cost+1, 0));
+	lost[0][0] = 0;
+	for(int i = 0; i < sets.size(); ++i)
+	{
+		const int n = sets[i].second;
+		const int deck = sets[i].first->_deck;
+		for(int v = 0; v <= cost; ++v)
+		{
+			if (lost[i][v] == none)
+				continue;
+			for(int k = 0; k <= n; ++k)
+			{
+				const int paid = std::min(cost, v+k*k*deck);
+				const int loss = lost[i][v]+(n*n-(n-k)*(n-k))*deck;
+				if (loss < lost[i+1][paid])
+				{
+					lost[i+1][paid] = loss;
+					took[i+1][paid] = k;
+					from[i+1][paid] = v;
+				}
+			}
+		}
+	}
+	if (lost[sets.size()][cost] == none)
+		return false;
+
+	for(int i = sets.size(), v = cost; i > 0; v = from[i][v], --i)
+	{
+		for(int k = 0; k < took[i][v]; ++k)
+			payment.insert(sets[i-1].first);
+	}
+	return true;
+}
+
 void RenderHand(std::ostream &out, const Hand &hand)
 {
 	if (hand.size() == 0)
@@ -101,7 +165,7 @@ bool Stage(Hand &src, Hand &dest, const Hand &cards)
 {
 	if (!RemoveHand(src, cards))
 		return false;
-	dest = cards;
+	dest.insert(cards.begin(), cards.end());
 	return true;
 }
 
@@ -110,30 +174,117 @@ void MergeDiscards(Game &g, const Hand &toss)
 	BOOST_FOREACH(auto card, toss)
 	{
 		g._discards[card->_deck].insert(card);
+		g._ledger.Add(card, CardLedger::Location(CardLedger::InDiscard, card->_deck));
+		g._undo.Cards(CardLedger::Location(CardLedger::InDiscard, card->_deck), card, 1);
 	}
 }
 
-void ShowCard(CivCardP c)
+const char *PlaceName(CardLedger::Kind kind)
+{
+	static const char *names[] = {"deck", "discard", "hand", "staging"};
+	return names[kind];
+}
+
+std::string LocationOwner(const Game &g, const CardLedger::Location &where)
+{
+	if (where._kind == CardLedger::InDeck || where._kind == CardLedger::InDiscard)
+		return boost::lexical_cast<std::string>(where._index);
+	if (where._index >= 0 && where._index < g._powerIds.size())
+		return g._powerIds[where._index]->_name;
+	return "?";
+}
+
+void FindUnbalanced(const Game &g, std::vector<std::pair<CardP, int> > &unbalanced)
+{
+	BOOST_FOREACH(auto card, g._cardIds)
+	{
+		const int total = g._ledger.Total(card);
+		if (total != card->_maxCount)
+			unbalanced.push_back(std::make_pair(card, total));
+	}
+}
+
+static bool placeOrder(const std::pair<CardLedger::Location, int> &l, const std::pair<CardLedger::Location, int> &r)
+{
+	if (l.first._kind != r.first._kind)
+		return l.first._kind < r.first._kind;
+	if (l.first._index != r.first._index)
+		return l.first._index < r.first._index;
+	return l.second < r.second;
+}
+
+void FindCardProblems(const Game &g, std::vector<Discrepancy> &problems)
+{
+	CardLedger counted;
+	g.Count(counted);
+
+	BOOST_FOREACH(auto card, g._cardIds)
+	{
+		CardLedger::Places kept(g._ledger.Find(card));
+		CardLedger::Places found(counted.Find(card));
+		std::sort(kept.begin(), kept.end(), placeOrder);
+		std::sort(found.begin(), found.end(), placeOrder);
+		if (!(kept.size() == found.size() && std::equal(kept.begin(), kept.end(), found.begin())))
+		{
+			const Discrepancy d = {card->_name, "ledger", g._ledger.Total(card), counted.Total(card)};
+			problems.push_back(d);
+		}
+		if (counted.Total(card) != card->_maxCount)
+		{
+			const Discrepancy d = {card->_name, "copies", card->_maxCount, counted.Total(card)};
+			problems.push_back(d);
+		}
+	}
+}
+
+int CheckCards(const Game &g, std::ostream &out)
+{
+	std::vector<Discrepancy> problems;
+	FindCardProblems(g, problems);
+	BOOST_FOREACH(auto &d, problems)
+	{
+		if (d._kind == "ledger")
+			out << d._name << ": ledger has " << d._kept << ", game has " << d._actual << std::endl;
+		else
+			out << d._name << ": " << d._actual << " of " << d._kept << std::endl;
+	}
+	return problems.size();
+}
+
+void HeldCalamities(const Game &g, std::vector<std::pair<CardP, PowerP> > &calamities)
+{
+	PowerCompare powerOrder;
+	BOOST_FOREACH(auto i, g._ledger.HeldCalamities())
+	{
+		const PowerP power = g._powerIds[i.first.second];
+		auto at = calamities.end();
+		while(at != calamities.begin() && (at-1)->first == i.first.first && powerOrder(power, (at-1)->second))
+			--at;
+		calamities.insert(at, i.second, std::make_pair(i.first.first, power));
+	}
+}
+
+void ShowCard(std::ostream &out, CivCardP c)
 {
 	const std::string groups[] = {"Craft", "Science", "Art", "Civic", "Religion"};
-	std::cout << c->_cost << '\t' << c->_name << " (" << c->_abbreviation << ')' << '\t';
+	out << c->_cost << '\t' << c->_name << " (" << c->_abbreviation << ')' << '\t';
 	for(int i = 0; i < CivCard::GroupSize; i++)
 	{
 		if (c->_groups[i])
-			std::cout << groups[i] << '\t';
+			out << groups[i] << '\t';
 	}
 	for(int i = 0; i < CivCard::GroupSize; i++)
 	{
 		if (c->_groupCredits[i] > 0)
-			std::cout << groups[i] << " (" << c->_groupCredits[i] << ')' << '\t';
+			out << groups[i] << " (" << c->_groupCredits[i] << ')' << '\t';
 	}
 	BOOST_FOREACH(auto i, c->_cardCredits)
 	{
-		std::cout << i.first->_name << " (" << i.second << ")" << '\t';
+		out << i.first->_name << " (" << i.second << ")" << '\t';
 	}
 	if (c->_evil)
-		std::cout << "EVIL";
-	std::cout << std::endl;
+		out << "EVIL";
+	out << std::endl;
 }
 
 bool ParseCivCards(const std::string &filename, Game &g)
@@ -174,7 +325,7 @@ bool ParseCivCards(const std::string &filename, Game &g)
 		card->_abbreviation = values[14];
 		card->_evil = values[15][0] == 'Y';
 		card->_image = "";
-		g._civcards.insert(card);
+		g.AddCivCard(card);
 	}
 	BOOST_FOREACH(auto card, bonus)
 	{
@@ -186,51 +337,15 @@ bool ParseCivCards(const std::string &filename, Game &g)
 	}
 
 	BOOST_FOREACH(auto card, g._civcards)
-		ShowCard(card);
+		ShowCard(std::cout, card);
+	return g._civcards.size();
 }
 
 Points CountPoints(const Game &g, const Power &p)
 {
 	Points points;
-
-	auto rules = g._vars.find("ruleset");
-	if (rules == g._vars.end())
-		return points;
-
-	if (rules->second == "AdvCiv")
-	{
-		int civPoints = 0;
-		BOOST_FOREACH(auto card, p._civCards._cards)
-		{
-			civPoints += card->_cost;
-		}
-		points.push_back(std::make_pair(std::string("Civ"),civPoints));
-	}
-	else if (rules->second == "CivProject21")
-	{
-		int civPoints = 0;
-		BOOST_FOREACH(auto card, p._civCards._cards)
-		{
-			civPoints += int(card->_cost/100)+1;
-		}
-
-		points.push_back(std::make_pair(std::string("Civ"),civPoints));
-	}
-	else if (rules->second == "CivProject30")
-	{
-		int civPoints = 0;
-		BOOST_FOREACH(auto card, p._civCards._cards)
-		{
-			int cost = card->_cost;
-			if (cost < 100)
-				civPoints += 1;
-			else if (cost <= 200)
-				civPoints += 3;
-			else
-				civPoints += 6;
-		}	
-		points.push_back(std::make_pair(std::string("Civ"),civPoints));
-	}
+	if (g.Rules())
+		points.push_back(std::make_pair(std::string("Civ"),p.Score()._civPoints[g.Rules()->Scoring()]));
 	return points;
 }
 
@@ -238,12 +353,13 @@ bool ParseCardLists(const std::string &filename, Game &g)
 {
 	int lastRead = 0;
 	std::ifstream in(filename.c_str(), std::ios::binary);
+	const bool supplements = g.Rules() && g.Rules()->Supplements();
 	
 	while(in.good())
 	{
 		CardP card(new Card);
 		in >> card->_deck >> card->_maxCount;
-		if (g._vars["ruleset"] == "CivProject30")
+		if (supplements)
 			in >> card->_supplement;
 		else
 			card->_supplement = false;
@@ -278,152 +394,168 @@ bool ParseCardLists(const std::string &filename, Game &g)
 		}
 		
 		if (in.good())
-			g._cards.insert(card);
+			g.AddCard(card);
 	}
 	
 	return g._cards.size();
 }
 
-void ShuffleIn(Deck &d, Hand &hand)
+static bool isShuffled(const CardP &card)
 {
-	Deck shuffled;
-	Deck unshuffled;
-
-	BOOST_FOREACH(auto i, hand)
-	{
-		if (i->_type == Card::NonTradable)
-			unshuffled.push_back(i);
-		else
-			shuffled.push_back(i);
-	}
+	return card->_type != Card::NonTradable;
+}
 
-	std::random_shuffle(shuffled.begin(), shuffled.end(), CivRand);
-	std::random_shuffle(unshuffled.begin(), unshuffled.end(), CivRand);
+void ShuffleIn(Deck &d, Hand &hand)
+{
+	// Non tradable calamities go to the bottom, each part shuffled in place
+	const Deck::iterator start = d.insert(d.end(), hand.begin(), hand.end());
+	const Deck::iterator split = std::partition(start, d.end(), isShuffled);
 
-	d.insert(d.end(), shuffled.begin(), shuffled.end());
-	d.insert(d.end(), unshuffled.begin(), unshuffled.end());
+	std::random_shuffle(start, split, CivRand);
+	std::random_shuffle(split, d.end(), CivRand);
 }
 
-bool CreateDecksCivProject30(Game &g)
+// Runs f on every deck from first on the pool.  Each deck gets its own
+// stream of a seed taken from the current generator, so the result doesn't
+// depend on which thread handled which deck.
+static void forEachDeck(Game &g, int first, ThreadPool &pool, const boost::function<void (int)> &f)
 {
-	g._decks.resize(10);
-	g._discards.resize(10);
+	const Rng::Seed seed = CurrentRng().NextSeed();
+	pool.ParallelFor(g._decks.size()-first, [&](int i)
+	{
+		Rng rng(seed, first+i);
+		ScopedRng scoped(rng);
+		f(first+i);
+	});
+}
 
-	for(int i = 1; i < g._decks.size(); ++i)
+void ReshuffleDecks(Game &g, ThreadPool &pool)
+{
+	std::vector<int> added(g._discards.size());
+	for(int i = 0; i < g._discards.size(); ++i)
 	{
-		std::vector<CardP> holding;
-		std::vector<CardP> supplement;
-		std::vector<CardP> nonTrade;
-		g._decks[i].clear();
-		BOOST_FOREACH(auto j, g._cards)
+		added[i] = g._discards[i].size();
+		BOOST_FOREACH(auto card, g._discards[i])
 		{
-			if (j->_deck != i)
-				continue;
-			if (j->_supplement)
-			{
-				supplement.insert(supplement.end(), j->_maxCount, j);
-				continue;
-			}
-			if (j->_type == Card::NonTradable)
-			{
-				nonTrade.push_back(j);
-				continue;
-			}
-			if (j->_type == Card::Tradable)
-			{
-				g._decks[i].insert(g._decks[i].end(), j);
-				continue;
-			}
-			if (j->_type == Card::Normal || j->_type == Card::Minor)
-			{
-				holding.insert(holding.end(), j->_maxCount, j);
-			}
+			g._ledger.Move(card, CardLedger::Location(CardLedger::InDiscard, i), CardLedger::Location(CardLedger::InDeck, i));
+			g._undo.Cards(CardLedger::Location(CardLedger::InDiscard, i), card, -1);
 		}
-		std::random_shuffle(holding.begin(), holding.end(), CivRand);
-
-		g._decks[i].insert(g._decks[i].begin(),holding.begin(), holding.end());
-		g._decks[i].insert(g._decks[i].end(), supplement.begin(), supplement.end());
-		g._decks[i].insert(g._decks[i].end(), nonTrade.begin(), nonTrade.end());
 	}
-	return true;
+
+	forEachDeck(g, 0, pool, [&g](int i)
+	{
+		ShuffleIn(g._decks[i], g._discards[i]);
+		g._discards[i].clear();
+	});
+
+	// ShuffleIn only shuffles the cards it puts on the bottom
+	for(int i = 0; i < g._decks.size() && i < added.size(); ++i)
+		g._undo.DeckEnd(i, Deck(g._decks[i].end()-added[i], g._decks[i].end()), 1);
 }
 
-bool CreateDecksAdvCiv(Game &g)
+// Catalog types in the order Cards sorts them within a deck
+static const Card::Type s_typeOrder[] = {Card::Minor, Card::NonTradable, Card::Tradable, Card::Normal};
+
+bool CivProject30Rules::CreateDeck(Game &g, int i)
 {
-	const int numPlayers = g._powers.size();
 	std::vector<CardP> holding;
-	g._decks.resize(10);
-	g._discards.resize(10);
-	
-	for(int i = 1; i < g._decks.size(); ++i)
+	std::vector<CardP> supplement;
+	std::vector<CardP> nonTrade;
+	g._decks[i].clear();
+	BOOST_FOREACH(auto type, s_typeOrder)
+	BOOST_FOREACH(auto j, g._catalog.Get(i, type))
 	{
-		holding.clear();
-
-		BOOST_FOREACH(auto card, g._cards)
+		if (j->_supplement)
 		{
-			if (card->_deck == i && (card->_type == Card::Normal || card->_type == Card::Minor))
-
-			{
-				holding.insert(holding.end(), card->_maxCount, card);
-			}
+			supplement.insert(supplement.end(), j->_maxCount, j);
+			continue;
 		}
-
-		std::random_shuffle(holding.begin(), holding.end(), CivRand);
-		
-		for(int j = 0; j < numPlayers && holding.size(); ++j)
+		if (j->_type == Card::NonTradable)
 		{
-			CardP b = holding.back();
-			g._decks[i].push_back(b);
-			holding.pop_back();
+			nonTrade.push_back(j);
+			continue;
 		}
-		
-		BOOST_FOREACH(auto card, g._cards)
+		if (j->_type == Card::Tradable)
 		{
-			if (card->_deck == i && (card->_type == Card::Tradable))
-			{
-				holding.push_back(card);
-			}
+			g._decks[i].insert(g._decks[i].end(), j);
+			continue;
 		}
-		
-		std::random_shuffle(holding.begin(), holding.end(), CivRand);
-		
-		for(Cards::const_iterator j = g._cards.begin(); j != g._cards.end(); j++)
-		BOOST_FOREACH(auto card, g._cards)
+		if (j->_type == Card::Normal || j->_type == Card::Minor)
 		{
-			if (card->_deck == i && card->_type == Card::NonTradable)
-			{
-				holding.push_back(card);
-			}			
+			holding.insert(holding.end(), j->_maxCount, j);
 		}
+	}
+	std::random_shuffle(holding.begin(), holding.end(), CivRand);
+
+	g._decks[i].insert(g._decks[i].begin(),holding.begin(), holding.end());
+	g._decks[i].insert(g._decks[i].end(), supplement.begin(), supplement.end());
+	g._decks[i].insert(g._decks[i].end(), nonTrade.begin(), nonTrade.end());
+	return true;
+}
+
+bool AdvCivRules::CreateDeck(Game &g, int i)
+{
+	const int numPlayers = g._powers.size();
+	std::vector<CardP> holding;
+
+	BOOST_FOREACH(auto card, g._catalog.Get(i, Card::Minor))
+		holding.insert(holding.end(), card->_maxCount, card);
+	BOOST_FOREACH(auto card, g._catalog.Get(i, Card::Normal))
+		holding.insert(holding.end(), card->_maxCount, card);
+
+	std::random_shuffle(holding.begin(), holding.end(), CivRand);
 	
-		if (!holding.size())
-			return false;
-		
-		g._decks[i].insert(g._decks[i].end(), holding.begin(), holding.end());
+	for(int j = 0; j < numPlayers && holding.size(); ++j)
+	{
+		CardP b = holding.back();
+		g._decks[i].push_back(b);
+		holding.pop_back();
 	}
 	
+	const CatalogIndex::Bucket &tradable = g._catalog.Get(i, Card::Tradable);
+	holding.insert(holding.end(), tradable.begin(), tradable.end());
+	
+	std::random_shuffle(holding.begin(), holding.end(), CivRand);
+	
+	const CatalogIndex::Bucket &nonTradable = g._catalog.Get(i, Card::NonTradable);
+	holding.insert(holding.end(), nonTradable.begin(), nonTradable.end());
+
+	if (!holding.size())
+		return false;
+	
+	g._decks[i].insert(g._decks[i].end(), holding.begin(), holding.end());
 	return true;
 }
 
+// Builds the decks on the pool, deck 0 is left empty
+bool CreateDecks(Game &g, int decks, bool (*createDeck)(Game &, int))
+{
+	g._decks.resize(decks);
+	g._discards.resize(decks);
+
+	std::vector<char> created(g._decks.size(), true);
+	forEachDeck(g, 1, ThreadPool::Shared(), [&](int i)
+	{
+		created[i] = createDeck(g, i);
+	});
+	g.Recount();
+	return std::find(created.begin(), created.end(), false) == created.end();
+}
+
 bool CreateDecks(Game &g)
 {
-	if (g._vars["ruleset"] == "AdvCiv")
-		return CreateDecksAdvCiv(g);
-	if (g._vars["ruleset"] == "CivProject30")
-		return CreateDecksCivProject30(g);
-	return false;
+	return g.Rules() && g.Rules()->CreateDecks(g);
 }
 
 bool ParsePowerList(const std::string &filename, Game &g)
 {
-	PlayerP player;
 	std::ifstream in(filename.c_str(), std::ios::binary);
 	while(in.good())
 	{
 		PowerP power(new Power);
 		std::getline(in, power->_name);
 		if (in.good())
-			g._powers[power] = player;
+			g.AddPower(power);
 	}
 	return g._powers.size() ;
 }
@@ -438,6 +570,7 @@ bool CreateGame(const std::string &cards, const std::string &powers, const std::
 	g._decks.empty();
 	g._discards.empty();
 	g._cards.empty();
+	g.Reindex();
 
 	return ParseCardLists(cards, g) &&
 		ParsePowerList(powers,g) &&
@@ -473,6 +606,8 @@ void PickCard(Game &g, Hand &hand, int i)
 {
 	if (g._decks[i].size() == 0)
 		return;
+	g._ledger.Add(g._decks[i].front(), CardLedger::Location(CardLedger::InDeck, i), -1);
+	g._undo.DeckFront(i, g._decks[i].front(), -1);
 	hand.insert(g._decks[i].front());
 	g._decks[i].pop_front();	
 }
@@ -2,6 +2,7 @@
 #define DBUILS_H
 
 #include "db.h"
+#include "pool.h"
 
 #include <vector>
 
@@ -19,13 +20,27 @@ enum dbErrors
 	ErrAbort,
 	ErrCardDeletion,
 	ErrGameCreation,
+	// Shell requests, continuable although they come after ErrQuit so the
+	// codes above keep their values
+	ErrFork,
+	ErrPromote,
+	ErrDiscard,
 };
 
+// False for the errors that end the shell
+bool Continuable(int error);
+
 int ValueHand(const Hand &hand);
+// Adds to payment the cards of hand worth at least cost that leave the rest
+// of the hand the most value.  Sets are worth count squared so paying with
+// part of one loses more than it pays.  False when the hand can't pay cost.
+bool ChoosePayment(const Hand &hand, int cost, Hand &payment);
 void RenderHand(std::ostream &out, const Hand &hand);
 void RenderDeck(std::ostream &out, const Deck &deck);
 void RenderCivPortfolio(std::ostream &out, const CivPortfolio &civCards);
 void ShuffleIn(Deck &d, Hand &hand);
+// Shuffles every discard pile into its deck, one deck per pool thread
+void ReshuffleDecks(Game &g, ThreadPool &pool = ThreadPool::Shared());
 void MergeHands(Hand &target, const Hand &src);
 void MergeDiscards(Game &g, const Hand &toss);
 bool RemoveHand(Hand &big, const Hand &deleted);
@@ -35,12 +50,40 @@ typedef std::vector<std::pair<std::string, int>> Points;
 Points CountPoints(const Game &h, const Power &p);
 
 bool CreateGame(const std::string &cards, const std::string &powers, const std::string &ruleset, Game &g);
+bool CreateDecks(Game &g);
 bool FillHand(const Game &g, const std::vector<std::string> &cardNames, Hand &hand);
 void FillCalamities(const Game &g, const Power &p, Hand &hand);
 void PickCard(Game &g, Hand &hand, int i);
 void DrawCards(Game &g, Hand &hand, int numCards);
 
 bool ParseCivCards(const std::string &filename, Game &g);
-void ShowCard(CivCardP c);
+void ShowCard(std::ostream &out, CivCardP c);
+
+// "deck", "discard", "hand" or "staging"
+const char *PlaceName(CardLedger::Kind kind);
+// Deck number or power name of a ledger location
+std::string LocationOwner(const Game &g, const CardLedger::Location &where);
+// Cards whose copies in the game don't add up to their _maxCount, with how
+// many there are
+void FindUnbalanced(const Game &g, std::vector<std::pair<CardP, int> > &unbalanced);
+// Something a check found wrong: the card or power, which total is off
+// ("ledger", "copies", "hand value" or "civ points"), the value kept or
+// expected and the value the game actually has
+struct Discrepancy
+{
+	std::string _name;
+	std::string _kind;
+	int _kept;
+	int _actual;
+};
+// Full scan: recounts every deck, discard pile, hand and staging area and
+// finds each card whose ledger entry is wrong or whose copies don't add up
+// to _maxCount
+void FindCardProblems(const Game &g, std::vector<Discrepancy> &problems);
+// FindCardProblems written to out.  Returns how many problems were found.
+int CheckCards(const Game &g, std::ostream &out);
+// Every calamity held, one entry per copy, in the order they resolve.  Powers
+// holding the same calamity are in turn order.
+void HeldCalamities(const Game &g, std::vector<std::pair<CardP, PowerP> > &calamities);
 
 #endif
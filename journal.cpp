@@ -0,0 +1,55 @@
+#include "journal.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+
+#include <fstream>
+#include <iostream>
+
+namespace fs = boost::filesystem;
+
+const char *Journal::BaseTag = "#base";
+const char *Journal::SeedTag = "#seed";
+
+Journal::Journal(const std::string &gameFile):_gameFile(gameFile),_filename(gameFile + ".journal")
+{}
+
+void Journal::Begin()
+{
+	// A game that was started before it had a journal is replayed from a copy
+	// of how it looked when the journal began
+	if (!fs::exists(_filename) && fs::exists(_gameFile))
+	{
+		const std::string base = _filename + ".base";
+		fs::copy_file(_gameFile, base, fs::copy_option::overwrite_if_exists);
+		_pending.push_back(std::string(BaseTag) + " " + base);
+	}
+
+	const Rng::Seed seed = DeviceSeed();
+	SeedSession(seed);
+	_pending.push_back(std::string(SeedTag) + " " + SeedToString(seed));
+}
+
+void Journal::Record(const std::string &line)
+{
+	_pending.push_back(line);
+}
+
+void Journal::Commit()
+{
+	if (_pending.empty())
+		return;
+
+	std::ofstream out(_filename.c_str(), std::ios::binary | std::ios::app);
+	BOOST_FOREACH(auto &line, _pending)
+	{
+		out << line << '\n';
+	}
+	out.flush();
+	if (!out.good())
+	{
+		std::cerr << "Unable to write " << _filename << std::endl;
+		return;
+	}
+	_pending.clear();
+}
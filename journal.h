@@ -0,0 +1,38 @@
+#ifndef JOURNAL_H__
+#define JOURNAL_H__
+
+#include "rng.h"
+
+#include <string>
+#include <vector>
+
+// Append only log of a game.  Each session writes the seed it gave the
+// session generator followed by every command that changed the game, so the
+// replay tool can rebuild the game as it was after any command.  Lines are
+// only appended when the game itself is saved, aborted sessions leave no trace.
+//
+//  #base file   game to start from when the journal began after the game did
+//  #seed hex    seed of the session generator from here on
+//  anything else is a command line
+class Journal
+{
+	public:
+		explicit Journal(const std::string &gameFile);
+
+		// Seeds the session generator and notes the seed
+		void Begin();
+		void Record(const std::string &line);
+		void Commit();
+
+		const std::string &Filename() const {return _filename;}
+
+		static const char *BaseTag;
+		static const char *SeedTag;
+
+	private:
+		std::string _gameFile;
+		std::string _filename;
+		std::vector<std::string> _pending;
+};
+
+#endif
@@ -0,0 +1,115 @@
+#include "match.h"
+
+#include <boost/foreach.hpp>
+
+#include <algorithm>
+#include <set>
+
+namespace
+{
+	const int MaxCycle = 4; // Offers in one cycle
+
+	bool ready(const OfferP &offer)
+	{
+		return offer->_power->_staging.empty() && offer->_power->Has(offer->_gives);
+	}
+
+	bool meets(const OfferP &giver, const OfferP &taker)
+	{
+		return std::includes(giver->_gives.begin(), giver->_gives.end(),
+			taker->_wants.begin(), taker->_wants.end(), CardCompare());
+	}
+
+	// Offer on a path ending at the start, next being the step it gives to
+	struct Step
+	{
+		OfferP _offer;
+		int _next;
+		int _length;
+	};
+
+	// Shortest cycle through start, searched back from start through the
+	// offers giving what each offer on the path wants
+	bool findCycle(const OfferBook &book, const OfferP &start, Cycle &cycle)
+	{
+		const Step first = {start, -1, 1};
+		std::vector<Step> steps(1, first);
+		std::set<int> seen;
+		seen.insert(start->_id);
+		for(int i = 0; i < steps.size(); ++i)
+		{
+			const Step step = steps[i];
+			if (step._length == MaxCycle)
+				continue;
+
+			std::vector<OfferP> givers;
+			book.Givers(step._offer->_wants, givers);
+			BOOST_FOREACH(auto &giver, givers)
+			{
+				if (seen.count(giver->_id) || !ready(giver))
+					continue;
+				bool repeated = false;
+				for(int j = i; j >= 0 && !repeated; j = steps[j]._next)
+					repeated = steps[j]._offer->_power == giver->_power;
+				if (repeated)
+					continue;
+
+				if (meets(start, giver))
+				{
+					cycle.push_back(start);
+					cycle.push_back(giver);
+					for(int j = i; j > 0; j = steps[j]._next)
+						cycle.push_back(steps[j]._offer);
+					return true;
+				}
+				seen.insert(giver->_id);
+				const Step next = {giver, i, step._length+1};
+				steps.push_back(next);
+			}
+		}
+		return false;
+	}
+
+	bool settle(const Cycle &cycle)
+	{
+		for(int i = 0; i < cycle.size(); ++i)
+		{
+			if (!cycle[i]->_power->Stage(cycle[i]->_gives))
+			{
+				for(int j = 0; j < i; ++j)
+					cycle[j]->_power->Merge();
+				return false;
+			}
+		}
+		// Swapping with the first power in turn leaves each power with what
+		// the one before it staged, and the first with the last one's cards
+		for(int i = 1; i < cycle.size(); ++i)
+			cycle[0]->_power->Exchange(*cycle[i]->_power);
+		BOOST_FOREACH(auto &offer, cycle)
+			offer->_power->Merge();
+		return true;
+	}
+}
+
+void MatchOffers(Game &g, std::vector<Cycle> &settled)
+{
+	std::vector<int> ids;
+	BOOST_FOREACH(auto &offer, g._offers._offers)
+		ids.push_back(offer.first);
+
+	BOOST_FOREACH(auto id, ids)
+	{
+		OfferP start = g._offers.Find(id);
+		if (!start || !ready(start))
+			continue;
+		Cycle cycle;
+		if (!findCycle(g._offers, start, cycle) || !settle(cycle))
+			continue;
+		BOOST_FOREACH(auto &offer, cycle)
+		{
+			g._offers.Withdraw(offer->_id);
+			g._undo.Post(offer, -1);
+		}
+		settled.push_back(cycle);
+	}
+}
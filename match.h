@@ -0,0 +1,18 @@
+#ifndef MATCH_H__
+#define MATCH_H__
+
+#include "db.h"
+
+#include <vector>
+
+// Offers met together, each handing its cards to the next and the last to
+// the first
+typedef std::vector<OfferP> Cycle;
+
+// Settles every pair and cycle of offers it can find, oldest offers first,
+// and takes them off the book.  All the cards of a cycle move or none do.
+// Offers whose power no longer holds what it gives, or has cards staged,
+// wait for a later match.
+void MatchOffers(Game &g, std::vector<Cycle> &settled);
+
+#endif
@@ -0,0 +1,194 @@
+#include "output.h"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/foreach.hpp>
+
+static OutputFormat s_format = FormatText;
+
+OutputFormat GetOutputFormat()
+{
+	return s_format;
+}
+
+const char *OutputFormatName(OutputFormat format)
+{
+	switch (format)
+	{
+		case FormatTSV:
+			return "tsv";
+		case FormatJSON:
+			return "json";
+		default:
+			return "text";
+	}
+}
+
+bool SetOutputFormat(const std::string &name)
+{
+	const OutputFormat formats[] = {FormatText, FormatTSV, FormatJSON};
+	BOOST_FOREACH(auto format, formats)
+	{
+		if (boost::iequals(name, OutputFormatName(format)))
+		{
+			s_format = format;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Structured()
+{
+	return s_format != FormatText;
+}
+
+static std::string escapeJSON(const std::string &value)
+{
+	std::string escaped;
+	escaped.reserve(value.size()+2);
+	BOOST_FOREACH(char c, value)
+	{
+		switch (c)
+		{
+			case '"':  escaped += "\\\""; break;
+			case '\\': escaped += "\\\\"; break;
+			case '\n': escaped += "\\n"; break;
+			case '\t': escaped += "\\t"; break;
+			case '\r': escaped += "\\r"; break;
+			default:
+				if (static_cast<unsigned char>(c) < 0x20)
+					escaped += ' ';
+				else
+					escaped += c;
+		}
+	}
+	return escaped;
+}
+
+RecordWriter::RecordWriter(std::ostream &out):_out(out),_format(s_format)
+{}
+
+RecordWriter::~RecordWriter()
+{
+	Flush();
+}
+
+void RecordWriter::Close()
+{
+	if (_type.empty())
+		return;
+
+	if (_format == FormatJSON)
+	{
+		_buffer += "{\"record\":\"" + escapeJSON(_type) + '"' + _row + "}\n";
+	}
+	else
+	{
+		std::string layout = _type;
+		BOOST_FOREACH(auto key, _keys)
+		{
+			layout += '\t' + key;
+		}
+		if (_layouts.insert(layout).second)
+			_buffer += '#' + layout + '\n';
+		_buffer += _type + _row + '\n';
+	}
+
+	_type.clear();
+	_row.clear();
+	_keys.clear();
+}
+
+RecordWriter &RecordWriter::Record(const std::string &type)
+{
+	Close();
+	_type = type;
+	return *this;
+}
+
+void RecordWriter::Append(const std::string &key, const std::string &value, bool quote)
+{
+	_keys.push_back(key);
+	if (_format == FormatJSON)
+	{
+		_row += ",\"" + escapeJSON(key) + "\":";
+		if (quote)
+			_row += '"' + escapeJSON(value) + '"';
+		else
+			_row += value;
+	}
+	else
+	{
+		std::string cell(value);
+		boost::replace_all(cell, "\t", " ");
+		boost::replace_all(cell, "\n", " ");
+		_row += '\t' + cell;
+	}
+}
+
+RecordWriter &RecordWriter::Field(const std::string &key, const std::string &value)
+{
+	Append(key, value, true);
+	return *this;
+}
+
+RecordWriter &RecordWriter::Field(const std::string &key, int value)
+{
+	Append(key, boost::lexical_cast<std::string>(value), false);
+	return *this;
+}
+
+RecordWriter &RecordWriter::Field(const std::string &key, unsigned long long value)
+{
+	Append(key, boost::lexical_cast<std::string>(value), false);
+	return *this;
+}
+
+void RecordWriter::Flush()
+{
+	Close();
+	if (_buffer.empty())
+		return;
+	_out.write(_buffer.data(), _buffer.size());
+	_out.flush();
+	_buffer.clear();
+}
+
+void WriteHand(RecordWriter &w, const std::string &type, const std::string &ownerKey, const std::string &owner, const Hand &hand)
+{
+	for(auto i = hand.begin(); i != hand.end(); i = hand.upper_bound(*i))
+	{
+		w.Record(type);
+		if (!ownerKey.empty())
+			w.Field(ownerKey, owner);
+		w.Field("card", (*i)->_name)
+			.Field("count", int(hand.count(*i)))
+			.Field("deck", (*i)->_deck)
+			.Field("type", int((*i)->_type));
+	}
+}
+
+void WriteCivCard(RecordWriter &w, CivCardP card)
+{
+	std::string groups, credits, bonus;
+	for(int i = 0; i < CivCard::GroupSize; ++i)
+	{
+		if (card->_groups[i])
+			groups += (groups.empty()?"":",") + CivCard::_groupList[i];
+		if (card->_groupCredits[i] > 0)
+			credits += (credits.empty()?"":",") + CivCard::_groupList[i] + ':' + boost::lexical_cast<std::string>(card->_groupCredits[i]);
+	}
+	BOOST_FOREACH(auto i, card->_cardCredits)
+	{
+		bonus += (bonus.empty()?"":",") + i.first->_name + ':' + boost::lexical_cast<std::string>(i.second);
+	}
+	w.Record("civcard")
+		.Field("civcard", card->_name)
+		.Field("abbreviation", card->_abbreviation)
+		.Field("cost", card->_cost)
+		.Field("groups", groups)
+		.Field("groupCredits", credits)
+		.Field("cardCredits", bonus)
+		.Field("evil", card->_evil?1:0);
+}
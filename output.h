@@ -0,0 +1,56 @@
+#ifndef OUTPUT_H__
+#define OUTPUT_H__
+
+#include "db.h"
+
+#include <ostream>
+#include <set>
+#include <string>
+#include <vector>
+
+enum OutputFormat
+{
+	FormatText,
+	FormatTSV,
+	FormatJSON,
+};
+
+OutputFormat GetOutputFormat();
+bool SetOutputFormat(const std::string &name);
+const char *OutputFormatName(OutputFormat format);
+
+// True when commands should emit records instead of the human readable text
+bool Structured();
+
+// Collects one record per line and writes them to the stream in a single
+// call when flushed (or destroyed).  TSV emits a '#' header line the first
+// time a record layout is seen, JSON emits one object per line.
+class RecordWriter
+{
+	public:
+		explicit RecordWriter(std::ostream &out);
+		~RecordWriter();
+
+		RecordWriter &Record(const std::string &type);
+		RecordWriter &Field(const std::string &key, const std::string &value);
+		RecordWriter &Field(const std::string &key, int value);
+		RecordWriter &Field(const std::string &key, unsigned long long value);
+		void Flush();
+
+	private:
+		void Close();
+		void Append(const std::string &key, const std::string &value, bool quote);
+
+		std::ostream &_out;
+		const OutputFormat _format;
+		std::string _buffer;
+		std::string _type;
+		std::string _row;
+		std::vector<std::string> _keys;
+		std::set<std::string> _layouts;
+};
+
+void WriteHand(RecordWriter &w, const std::string &type, const std::string &ownerKey, const std::string &owner, const Hand &hand);
+void WriteCivCard(RecordWriter &w, CivCardP card);
+
+#endif
@@ -1,6 +1,14 @@
 #include "parser.h"
 #include "dbUtils.h"
 #include "factory.h"
+#include "output.h"
+#include "stats.h"
+#include "rng.h"
+#include "plan.h"
+#include "simulate.h"
+#include "trades.h"
+#include "match.h"
+#include "scores.h"
 
 #include <boost/algorithm/string.hpp>
 #include <boost/bind.hpp>
@@ -14,26 +22,64 @@ namespace fs = boost::filesystem;
 #include <boost/function.hpp>
 #include <boost/serialization/singleton.hpp>
 #include <boost/foreach.hpp>
+#include <cstdio>
 #include <iostream>
 #include <vector>
 
 typedef boost::function<int (const std::vector<std::string> &, Game &, std::ostream &)> ParseFunc;
 
-typedef FactoryOwner<ParseFunc> Parser;
+// Stats are looked up once here rather than on every line
+struct Command
+{
+	ParseFunc _parse;
+	CommandStats *_stats;
+};
+
+typedef FactoryOwner<Command> Parser;
 typedef boost::serialization::singleton<Parser> ParseFactory;
 
+static Command command(const ParseFunc &parse, const char *name)
+{
+	const Command c = {parse, &StatsFor(name)};
+	return c;
+}
+
 #define REG_PARSE(_trigger, _str) \
 	static bool _trigger ## _parse_registered = \
-		ParseFactory::get_mutable_instance().Register(#_trigger, parse##_trigger); \
+		ParseFactory::get_mutable_instance().Register(#_trigger, command(parse##_trigger, #_trigger)); \
 	static bool _trigger ## _help_registered = \
 		HelpFactory::get_mutable_instance().Register(#_trigger, \
 				boost::bind(GenericHelp,#_trigger " " _str,_1))
 
 
+// Marks a command as one that changes the game
+#define REG_MUTATES(_trigger) \
+	static bool _trigger ## _mutates_registered = \
+		MutateFactory::get_mutable_instance().Register(#_trigger, true)
+
+typedef FactoryOwner<bool> Mutators;
+typedef boost::serialization::singleton<Mutators> MutateFactory;
+
 typedef boost::function<void (std::ostream &)> HelpFunc;
 typedef FactoryOwner<HelpFunc> Helper;
 typedef boost::serialization::singleton<Helper> HelpFactory;
 
+// A count typed by the user, false rather than a throw when it isn't one
+static bool readCount(const std::string &s, int &n)
+{
+	if (s.empty() || !boost::all(s, boost::is_digit()))
+		return false;
+	try
+	{
+		n = boost::lexical_cast<int>(s);
+	}
+	catch(const boost::bad_lexical_cast &)
+	{
+		return false;
+	}
+	return true;
+}
+
 void GenericHelp(const std::string &d, std::ostream &out)
 {
 	out << d << std::endl;
@@ -64,6 +110,7 @@ int parseImport(const std::vector<std::string> &names, Game &g, std::ostream &ou
 	return ErrUnableToParse;
 }
 REG_PARSE(Import, "Civ file");
+REG_MUTATES(Import);
 
 int parseBuy(const std::vector<std::string> &names, Game &g, std::ostream &out)
 {
@@ -92,6 +139,7 @@ int parseBuy(const std::vector<std::string> &names, Game &g, std::ostream &out)
 	Hand left;
 	CivCards right;
 	bool free = false;
+	bool autoPay = false;
 	int tokens = 0;
 	for(int i = 2; i < breakPoint; ++i)
 	{
@@ -100,6 +148,8 @@ int parseBuy(const std::vector<std::string> &names, Game &g, std::ostream &out)
 		{
 			if (boost::iequals(names[i],"free"))
 				free = true;
+			else if (boost::iequals(names[i],"auto"))
+				autoPay = true;
 			else if (boost::all(names[i],boost::is_digit()))
 				tokens += boost::lexical_cast<int>(names[i]);
 			else
@@ -132,23 +182,57 @@ int parseBuy(const std::vector<std::string> &names, Game &g, std::ostream &out)
 	{
 		cost += power->first->_civCards.Cost(i);	
 	}
+
+	if (autoPay && !free)
+	{
+		if (!left.empty())
+			return ErrUnableToParse;
+		if (!ChoosePayment(power->first->_hand, cost-tokens, left))
+			left = power->first->_hand;
+	}
 	
 	int value = ValueHand(left);
 	if (tokens+value < cost && !free)
 	{
-		out << "Missing " << cost-tokens-value << std::endl;
+		if (Structured())
+			RecordWriter(out).Record("missing")
+				.Field("power", power->first->_name)
+				.Field("missing", cost-tokens-value);
+		else
+			out << "Missing " << cost-tokens-value << std::endl;
 		return ErrInsufficientFunds;	
 	}
 
-	if (!RemoveHand(power->first->_hand, left))
+	if (!power->first->Remove(left))
 		return ErrCardDeletion;
 
 	MergeDiscards(g, left);
 
 	BOOST_FOREACH(auto i, right)
 	{
-		power->first->_civCards._cards.insert(i);
-		std::cout << "Adding: " << i->_name << std::endl;
+		power->first->AddCivCard(i);
+	}
+
+	if (Structured())
+	{
+		RecordWriter w(out);
+		WriteHand(w, "paid", "power", power->first->_name, left);
+		BOOST_FOREACH(auto i, right)
+		{
+			w.Record("bought").Field("power", power->first->_name).Field("civcard", i->_name);
+		}
+		w.Record("purchase")
+			.Field("power", power->first->_name)
+			.Field("free", free?1:0)
+			.Field("tokens", tokens)
+			.Field("paid", value+tokens)
+			.Field("cost", cost);
+		return ErrNone;
+	}
+
+	BOOST_FOREACH(auto i, right)
+	{
+		out << "Adding: " << i->_name << std::endl;
 	}
 
 	out << power->first->_name << " Gives: \n";
@@ -173,7 +257,8 @@ int parseBuy(const std::vector<std::string> &names, Game &g, std::ostream &out)
 	
 	return ErrNone;
 }
-REG_PARSE(Buy, "Power Card/Token#/Free ... CivCard ...");
+REG_PARSE(Buy, "Power Card/Token#/Free/Auto ... CivCard ...");
+REG_MUTATES(Buy);
 
 int parseCost(const std::vector<std::string> &names, Game &g, std::ostream &out)
 {
@@ -185,7 +270,13 @@ int parseCost(const std::vector<std::string> &names, Game &g, std::ostream &out)
 		auto card = g.FindCivCard(names[1]);
 		if (!card)
 			return ErrUnableToParse;
-		ShowCard(card);
+		if (Structured())
+		{
+			RecordWriter w(out);
+			WriteCivCard(w, card);
+		}
+		else
+			ShowCard(out, card);
 		return ErrNone;
 	}
 	else if (names.size() == 3)
@@ -199,7 +290,13 @@ int parseCost(const std::vector<std::string> &names, Game &g, std::ostream &out)
 			return ErrUnableToParse;
 
 		int cost = power->first->_civCards.Cost(card);	
-		std::cout << card->_name << " costs " << power->first->_name << " " << cost << std::endl;
+		if (Structured())
+			RecordWriter(out).Record("cost")
+				.Field("power", power->first->_name)
+				.Field("civcard", card->_name)
+				.Field("cost", cost);
+		else
+			out << card->_name << " costs " << power->first->_name << " " << cost << std::endl;
 		return ErrNone;
 	}
 	return ErrUnableToParse;
@@ -207,6 +304,121 @@ int parseCost(const std::vector<std::string> &names, Game &g, std::ostream &out)
 }
 REG_PARSE(Cost, "CivCard");
 
+int parsePlan(const std::vector<std::string> &names, Game &g, std::ostream &out)
+{
+	if (names.size() != 2 && names.size() != 3)
+		return parseHelpC(names, g, out);
+
+	auto power = g.FindPower(names[1]);
+	if (power == g._powers.end())
+		return ErrPowerNotFound;
+	int tokens = 0;
+	if (names.size() == 3 && !readCount(names[2], tokens))
+		return ErrUnableToParse;
+
+	std::vector<Purchase> plans;
+	bool complete;
+	if (!PlanPurchases(g, *power->first, tokens, 5, plans, complete))
+		return ErrUnableToParse;
+
+	if (Structured())
+	{
+		RecordWriter w(out);
+		for(int i = 0; i < plans.size(); ++i)
+		{
+			std::string cards;
+			BOOST_FOREACH(auto card, plans[i]._cards)
+				cards += (cards.empty()?"":",") + card->_name;
+			w.Record("plan").Field("power", power->first->_name)
+				.Field("rank", i+1)
+				.Field("points", plans[i]._points)
+				.Field("cost", plans[i]._cost)
+				.Field("civcards", cards)
+				.Field("complete", complete?1:0);
+		}
+		return ErrNone;
+	}
+
+	out << "Budget " << tokens+power->first->Score()._handValue << std::endl;
+	if (plans.empty())
+		out << "Nothing affordable" << std::endl;
+	for(int i = 0; i < plans.size(); ++i)
+	{
+		out << i+1 << ". " << plans[i]._points << " points for " << plans[i]._cost << ":";
+		BOOST_FOREACH(auto card, plans[i]._cards)
+			out << ' ' << card->_name << ',';
+		out << std::endl;
+	}
+	if (!complete)
+		out << "Too many sets to search them all, these are the best found" << std::endl;
+	return ErrNone;
+}
+REG_PARSE(Plan, "Power [Tokens]");
+
+static std::string percent(int n, int of)
+{
+	char buffer[16];
+	std::snprintf(buffer, sizeof(buffer), "%.1f%%", of?n*100.0/of:0.0);
+	return buffer;
+}
+
+int parseSimulate(const std::vector<std::string> &names, Game &g, std::ostream &out)
+{
+	if ((names.size() != 5 && names.size() != 6) || !boost::iequals(names[1], "draw"))
+		return parseHelpC(names, g, out);
+
+	auto power = g.FindPower(names[2]);
+	if (power == g._powers.end())
+		return ErrPowerNotFound;
+	int cards, iterations;
+	if (!readCount(names[3], cards) || !readCount(names[4], iterations) || iterations <= 0 || iterations > MaxSimulatedDraws)
+		return ErrUnableToParse;
+
+	// Not from the session generator, the journal doesn't replay simulations
+	Rng::Seed seed = DeviceSeed();
+	if (names.size() == 6 && !SeedFromString(names[5], seed))
+		return ErrUnableToParse;
+
+	DrawOdds odds;
+	SimulateDraws(g, *power->first, cards, iterations, seed, odds);
+
+	if (Structured())
+	{
+		RecordWriter w(out);
+		w.Record("odds")
+			.Field("power", power->first->_name)
+			.Field("cards", cards)
+			.Field("iterations", iterations)
+			.Field("seed", SeedToString(seed))
+			.Field("mean", (int)(odds.Mean()+0.5))
+			.Field("p10", odds.Percentile(0.1))
+			.Field("p50", odds.Percentile(0.5))
+			.Field("p90", odds.Percentile(0.9))
+			.Field("max", odds._values.back());
+		for(int i = 0; i < odds._calamities.size(); ++i)
+			w.Record("calamities").Field("count", i).Field("draws", odds._calamities[i]);
+		BOOST_FOREACH(auto &i, odds._byCalamity)
+			w.Record("calamity").Field("card", i.first->_name).Field("draws", i.second);
+		return ErrNone;
+	}
+
+	out << power->first->_name << " drawing " << cards << ", " << iterations
+		<< " times, seed " << SeedToString(seed) << std::endl;
+	out << "Value: mean " << (int)(odds.Mean()+0.5)
+		<< ", 10% " << odds.Percentile(0.1)
+		<< ", 50% " << odds.Percentile(0.5)
+		<< ", 90% " << odds.Percentile(0.9)
+		<< ", max " << odds._values.back() << std::endl;
+	out << "Calamities:";
+	for(int i = 0; i < odds._calamities.size(); ++i)
+		out << ' ' << i << ": " << percent(odds._calamities[i], iterations) << ',';
+	out << std::endl;
+	BOOST_FOREACH(auto &i, odds._byCalamity)
+		out << i.first->_name << ": " << percent(i.second, iterations) << std::endl;
+	return ErrNone;
+}
+REG_PARSE(Simulate, "Draw Power #Cards Iterations [Seed]");
+
 int parseCreate(const std::vector<std::string> &names, Game &g, std::ostream &out)
 {
 	if (names.size() != 4)
@@ -218,6 +430,7 @@ int parseCreate(const std::vector<std::string> &names, Game &g, std::ostream &ou
 	return ErrNone;
 }
 REG_PARSE(Create,"CardList PowerList RuleSet");
+REG_MUTATES(Create);
 
 int parseGive(const std::vector<std::string> &names, Game &g, std::ostream &out)
 {
@@ -236,9 +449,9 @@ int parseGive(const std::vector<std::string> &names, Game &g, std::ostream &out)
 	{
 		if (boost::algorithm::iequals(names[3],"Random"))
 		{
-			Deck d(from->first->_hand.begin(), from->first->_hand.end());
-			std::random_shuffle(d.begin(), d.end(), CivRand);
-			card = d[0];
+			card = from->first->RandomCard(CurrentRng());
+			if (!card)
+				return ErrCardNotFound;
 		}
 		else
 		{
@@ -252,26 +465,40 @@ int parseGive(const std::vector<std::string> &names, Game &g, std::ostream &out)
 		return ErrCardNotFound;
 	}
 	
-	if (!Stage(from->first->_hand, from->first->_staging, left))
+	if (!from->first->Stage(left))
 	{
 		return ErrCardDeletion;
 	}
 	
-	std::swap(from->first->_staging, to->first->_staging);
+	from->first->Exchange(*to->first);
 	
 	from->first->Merge(); to->first->Merge();
 
+	if (Structured())
+	{
+		RecordWriter w(out);
+		BOOST_FOREACH(auto i, left)
+		{
+			w.Record("gave")
+				.Field("from", from->first->_name)
+				.Field("to", to->first->_name)
+				.Field("card", i->_name);
+		}
+		return ErrNone;
+	}
+
 	out << from->first->_name << " Gives: \n";
 
 	BOOST_FOREACH(auto i, left)
 	{
 		out << i->_name << ',';
 	}
-	std:: cout << std::endl << std::endl;
+	out << std::endl << std::endl;
 	
 	return ErrNone;
 }
 REG_PARSE(Give, "FromPower ToPower Card/Random");
+REG_MUTATES(Give);
 
 int parseGrant(const std::vector<std::string> &names, Game &g, std::ostream &out)
 {
@@ -291,12 +518,14 @@ int parseGrant(const std::vector<std::string> &names, Game &g, std::ostream &out
 			quantity = boost::lexical_cast<int>(names[3]);
 
 	i->first->_civCards._bonusCredits[group] += quantity;
+	g._undo.Credits(i->first->Id(), group, quantity);
 	
 	out << "Granted: " << quantity << " to " << i->first->_name << std::endl;
 	out << "Total now, " << i->first->_civCards._bonusCredits[group] << std::endl;
 	return ErrNone;
 }
 REG_PARSE(Grant, "");
+REG_MUTATES(Grant);
 
 int parseSave(const std::vector<std::string> &names, Game &, std::ostream &)
 {
@@ -304,6 +533,53 @@ int parseSave(const std::vector<std::string> &names, Game &, std::ostream &)
 }
 REG_PARSE(Save, "");
 
+int parseUndo(const std::vector<std::string> &names, Game &g, std::ostream &out)
+{
+	if (names.size() != 1)
+		return parseHelpC(names, g, out);
+
+	std::string line;
+	if (!g._undo.Undo(g, line))
+	{
+		out << "Nothing to undo" << std::endl;
+		return ErrUnableToParse;
+	}
+	out << "Undone: " << line << std::endl;
+	return ErrNone;
+}
+REG_PARSE(Undo, "");
+REG_MUTATES(Undo);
+
+int parseRedo(const std::vector<std::string> &names, Game &g, std::ostream &out)
+{
+	if (names.size() != 1)
+		return parseHelpC(names, g, out);
+
+	std::string line;
+	if (!g._undo.Redo(g, line))
+	{
+		out << "Nothing to redo" << std::endl;
+		return ErrUnableToParse;
+	}
+	out << "Redone: " << line << std::endl;
+	return ErrNone;
+}
+REG_PARSE(Redo, "");
+REG_MUTATES(Redo);
+
+// The shell keeps the fork, commands go to it until it is promoted or discarded
+int parseFork(const std::vector<std::string> &names, Game &g, std::ostream &out)
+{
+	if (names.size() == 1)
+		return ErrFork;
+	if (names.size() == 2 && boost::iequals(names[1], "promote"))
+		return ErrPromote;
+	if (names.size() == 2 && boost::iequals(names[1], "discard"))
+		return ErrDiscard;
+	return parseHelpC(names, g, out);
+}
+REG_PARSE(Fork, "[Promote/Discard]");
+
 int parseSet(const std::vector<std::string> &names, Game &g, std::ostream &out)
 {
 	if (names.size() > 3)
@@ -311,6 +587,15 @@ int parseSet(const std::vector<std::string> &names, Game &g, std::ostream &out)
 
 	if (names.size() == 1)
 	{
+		if (Structured())
+		{
+			RecordWriter w(out);
+			BOOST_FOREACH(auto i, g._vars)
+			{
+				w.Record("variable").Field("name", i.first).Field("value", i.second);
+			}
+			return ErrNone;
+		}
 		BOOST_FOREACH(auto i, g._vars)
 		{
 			out << i.first << ": '" << i.second << "'" << std::endl;	
@@ -327,19 +612,49 @@ int parseSet(const std::vector<std::string> &names, Game &g, std::ostream &out)
 
 	if (names.size() == 2)
 	{
-		out << i->first << ": '" << i->second << "'" << std::endl;
+		if (Structured())
+			RecordWriter(out).Record("variable").Field("name", i->first).Field("value", i->second);
+		else
+			out << i->first << ": '" << i->second << "'" << std::endl;
 		return ErrNone;
 	}
 
 	if (names.size() == 3)
 	{
+		g._undo.Variable(i->first, i->second);
 		i->second = names[2];
+		g.ResolveRules();
 		return ErrNone;
 	}
 
 	return ErrUnableToParse;
 }
 REG_PARSE(Set, "Variable Value");
+REG_MUTATES(Set);
+
+int parseFormat(const std::vector<std::string> &names, Game &g, std::ostream &out)
+{
+	if (names.size() > 2)
+		return parseHelpC(names, g, out);
+
+	if (names.size() == 2 && !SetOutputFormat(names[1]))
+		return ErrUnableToParse;
+
+	if (names.size() == 1)
+		out << OutputFormatName(GetOutputFormat()) << std::endl;
+	return ErrNone;
+}
+REG_PARSE(Format, "text/tsv/json");
+
+int parseStats(const std::vector<std::string> &names, Game &g, std::ostream &out)
+{
+	if (names.size() != 1)
+		return parseHelpC(names, g, out);
+
+	RenderStats(out);
+	return ErrNone;
+}
+REG_PARSE(Stats, "");
 
 int parseQuit(const std::vector<std::string> &names, Game &, std::ostream &)
 {
@@ -370,18 +685,29 @@ int parseDiscard(const std::vector<std::string> &names, Game &g, std::ostream &o
 		return ErrCardNotFound;
 	
 	FillCalamities(g, *power->first, toss);
-	RenderHand(out, toss);
-	out << std::endl;
+	if (!Structured())
+	{
+		RenderHand(out, toss);
+		out << std::endl;
+	}
 	
-	if (!RemoveHand(power->first->_hand, toss))
+	if (!power->first->Remove(toss))
 		return ErrCardDeletion;
 
 	MergeDiscards(g, toss);
-	RenderHand(out, power->first->_hand);
+	if (Structured())
+	{
+		RecordWriter w(out);
+		WriteHand(w, "discarded", "power", power->first->_name, toss);
+		WriteHand(w, "held", "power", power->first->_name, power->first->_hand);
+	}
+	else
+		RenderHand(out, power->first->_hand);
 	
 	return ErrNone;
 }
 REG_PARSE(Discard, "Power [Card] ...");
+REG_MUTATES(Discard);
 
 int parseDraw(const std::vector<std::string> &names, Game &g, std::ostream &out)
 {
@@ -401,28 +727,39 @@ int parseDraw(const std::vector<std::string> &names, Game &g, std::ostream &out)
 		return ErrPowerNotFound;
 	}
 	
-	out << "Held:" << std::endl;
-	RenderHand(out, power->first->_hand);
-	
 	Hand tempHand;
-	out << std::endl << "Drawn:" << std::endl;
 	DrawCards(g, tempHand, numCards);
-	RenderHand(out, tempHand);
 	
 	Hand temp2;
-	out << std::endl << "Bought:" << std::endl;
 	BOOST_FOREACH(auto card, picks)
 	{
 		PickCard(g, temp2, card);
 	}
-	RenderHand(out, temp2);
+
+	if (Structured())
+	{
+		RecordWriter w(out);
+		WriteHand(w, "held", "power", power->first->_name, power->first->_hand);
+		WriteHand(w, "drawn", "power", power->first->_name, tempHand);
+		WriteHand(w, "bought", "power", power->first->_name, temp2);
+	}
+	else
+	{
+		out << "Held:" << std::endl;
+		RenderHand(out, power->first->_hand);
+		out << std::endl << "Drawn:" << std::endl;
+		RenderHand(out, tempHand);
+		out << std::endl << "Bought:" << std::endl;
+		RenderHand(out, temp2);
+	}
 	
 	MergeHands(tempHand, temp2);
-	MergeHands(power->first->_hand, tempHand);
+	power->first->Add(tempHand);
 
 	return ErrNone;	
 }
 REG_PARSE(Draw,"Power #Cards [Pick] ...");
+REG_MUTATES(Draw);
 
 int parseDump(const std::vector<std::string> &names, Game &g, std::ostream &out)
 {
@@ -433,20 +770,16 @@ int parseDump(const std::vector<std::string> &names, Game &g, std::ostream &out)
 	fs::ofstream cardList(base/"cardList", std::ios::binary);
 	fs::ofstream powerList(base/"powerList", std::ios::binary);
 	fs::ofstream civcardList(base/"civcardList", std::ios::binary);
+	const Card::Type calamities[] = {Card::Minor, Card::NonTradable, Card::Tradable};
 	for(int i = 0; i < g._decks.size(); ++i)
 	{
-		BOOST_FOREACH(auto j, g._cards)
-		{
-			if (i == j->_deck && j->_type == Card::Normal)
-				cardList << i << '\t' << j->_maxCount << '\t' << j->_name << std::endl;
-		}	
+		BOOST_FOREACH(auto j, g._catalog.Get(i, Card::Normal))
+			cardList << i << '\t' << j->_maxCount << '\t' << j->_name << std::endl;
 
-		BOOST_FOREACH(auto j, g._cards)
+		BOOST_FOREACH(auto type, calamities)
+		BOOST_FOREACH(auto j, g._catalog.Get(i, type))
 		{
-			if (i == j->_deck && j->_type != Card::Normal)
-			{
-				cardList << j->_type << '\t' << 1 << '\t' << j->_name << std::endl;
-			}
+			cardList << j->_type << '\t' << 1 << '\t' << j->_name << std::endl;
 		}
 	}
 
@@ -580,17 +913,8 @@ void ExportCivCards(std::ostream &out, const Game &g)
 	out << "</tbody>" << std::endl;
 }
 
-int parseExport(const std::vector<std::string> &names, Game &g, std::ostream &out)
+static void exportFiles(const fs::path &base, const Game &g)
 {
-	if (names.size() != 2)
-		return parseHelpC(names, g, out);
-
-	fs::path base;
-	if (boost::iequals(names[1], "default"))
-		base = g._vars["export"];
-	else
-		base = names[1];
-
 	fs::ofstream auth(base / "auth");
 	fs::ofstream contact(base / "contact");
 	fs::ofstream civCards(base / "civcards");
@@ -615,12 +939,29 @@ int parseExport(const std::vector<std::string> &names, Game &g, std::ostream &ou
 			civOut << j->_image << std::endl;
 		}
 	}
+}
+
+int parseExport(const std::vector<std::string> &names, Game &g, std::ostream &out)
+{
+	if (names.size() != 2)
+		return parseHelpC(names, g, out);
+
+	fs::path base;
+	if (boost::iequals(names[1], "default"))
+		base = g._vars["export"];
+	else
+		base = names[1];
+
+	if (FileOutput())
+		exportFiles(base, g);
 
 	out << "Exported to: " << base << std::endl;
+	g._undo.Variable("export", g._vars["export"]);
 	g._vars["export"] = base.string();
 	return ErrNone;
 }
 REG_PARSE(Export, "DestinationDir");
+REG_MUTATES(Export);
 
 int parseHeld(const std::vector<std::string> &names, Game &g, std::ostream &out)
 {
@@ -632,7 +973,16 @@ int parseHeld(const std::vector<std::string> &names, Game &g, std::ostream &out)
 		int deck = boost::lexical_cast<int>(names[1]);
 		if (deck > 0 && deck < g._decks.size())
 		{
-			RenderDeck(out, g._decks[deck]);
+			if (Structured())
+			{
+				RecordWriter w(out);
+				for(int i = 0; i < g._decks[deck].size(); ++i)
+				{
+					w.Record("deck").Field("deck", deck).Field("position", i).Field("card", g._decks[deck][i]->_name);
+				}
+			}
+			else
+				RenderDeck(out, g._decks[deck]);
 			return ErrNone;
 		}
 	} 
@@ -641,6 +991,15 @@ int parseHeld(const std::vector<std::string> &names, Game &g, std::ostream &out)
 	}
 	if (boost::icontains(names[1],"discard"))
 	{
+		if (Structured())
+		{
+			RecordWriter w(out);
+			for(int i = 1; i < g._discards.size(); ++i)
+			{
+				WriteHand(w, "discard", "pile", boost::lexical_cast<std::string>(i), g._discards[i]);
+			}
+			return ErrNone;
+		}
 		for(int i = 1; i < g._discards.size(); ++i)
 		{
 			out << i << ": ";
@@ -655,6 +1014,25 @@ int parseHeld(const std::vector<std::string> &names, Game &g, std::ostream &out)
 		return ErrPowerNotFound;
 	}
 	
+	if (Structured())
+	{
+		const std::string &name = power->first->_name;
+		RecordWriter w(out);
+		WriteHand(w, "held", "power", name, power->first->_hand);
+		w.Record("value").Field("power", name).Field("value", power->first->Score()._handValue);
+		BOOST_FOREACH(auto card, power->first->_civCards._cards)
+		{
+			w.Record("civcard").Field("power", name).Field("civcard", card->_name);
+		}
+		for(int i = 0; i < CivCard::GroupSize; ++i)
+		{
+			w.Record("bonus").Field("power", name)
+				.Field("group", CivCard::_groupList[i])
+				.Field("credits", power->first->_civCards._bonusCredits[i]);
+		}
+		return ErrNone;
+	}
+
 	RenderHand(out, power->first->_hand);
 	RenderCivPortfolio(out, power->first->_civCards);
 
@@ -680,11 +1058,13 @@ int parseSetPlayer(const std::vector<std::string> &names, Game &g, std::ostream
 	player->_password = names[3];
 	player->_email = names[4];
 	
+	g._undo.Assign(power->first->Id(), power->second);
 	power->second = player;
 
 	return ErrNone;
 }
 REG_PARSE(SetPlayer,"Power Name Password EMail");
+REG_MUTATES(SetPlayer);
 
 int parseTrade(const std::vector<std::string> &names, Game &g, std::ostream &out)
 {
@@ -732,16 +1112,24 @@ int parseTrade(const std::vector<std::string> &names, Game &g, std::ostream &out
 		return ErrCardNotFound;
 	}
 	
-	if (!Stage(power->first->_hand, power->first->_staging, left) ||
-		!Stage(power2->first->_hand, power2->first->_staging, right))
+	if (!power->first->Stage(left) ||
+		!power2->first->Stage(right))
 	{
 		return ErrCardDeletion;
 	}
 	
-	std::swap(power->first->_staging, power2->first->_staging);
+	power->first->Exchange(*power2->first);
 	
 	power->first->Merge(); power2->first->Merge();
 
+	if (Structured())
+	{
+		RecordWriter w(out);
+		WriteHand(w, "traded", "from", power->first->_name, left);
+		WriteHand(w, "traded", "from", power2->first->_name, right);
+		return ErrNone;
+	}
+
 	out << power->first->_name << " Gives: \n";
 	BOOST_FOREACH(auto i, left)
 	{
@@ -759,6 +1147,215 @@ int parseTrade(const std::vector<std::string> &names, Game &g, std::ostream &out
 	return ErrNone;
 }
 REG_PARSE(Trade,"Power Card Card Card ... Power Card Card Card ...");
+REG_MUTATES(Trade);
+
+int parseTrades(const std::vector<std::string> &names, Game &g, std::ostream &out)
+{
+	if (names.size() > 2)
+		return parseHelpC(names, g, out);
+
+	PowerP power;
+	if (names.size() == 2)
+	{
+		auto found = g.FindPower(names[1]);
+		if (found == g._powers.end())
+			return ErrPowerNotFound;
+		power = found->first;
+	}
+
+	std::vector<TradeOffer> offers;
+	FindTrades(g, power, offers);
+
+	if (Structured())
+	{
+		RecordWriter w(out);
+		BOOST_FOREACH(auto &offer, offers)
+		{
+			std::string gives, gets;
+			BOOST_FOREACH(auto card, offer._gives)
+				gives += (gives.empty()?"":",") + card->_name;
+			BOOST_FOREACH(auto card, offer._gets)
+				gets += (gets.empty()?"":",") + card->_name;
+			w.Record("offer")
+				.Field("from", offer._from->_name)
+				.Field("gives", gives)
+				.Field("fromGain", offer._fromGain)
+				.Field("to", offer._to->_name)
+				.Field("gets", gets)
+				.Field("toGain", offer._toGain);
+		}
+		return ErrNone;
+	}
+
+	if (offers.empty())
+		out << "No trade helps both sides" << std::endl;
+	BOOST_FOREACH(auto &offer, offers)
+	{
+		out << "trade " << offer._from->_name;
+		BOOST_FOREACH(auto card, offer._gives)
+			out << ' ' << boost::replace_all_copy(card->_name, " ", "\\ ");
+		out << ' ' << offer._to->_name;
+		BOOST_FOREACH(auto card, offer._gets)
+			out << ' ' << boost::replace_all_copy(card->_name, " ", "\\ ");
+		out << "\t+" << offer._fromGain << " +" << offer._toGain << std::endl;
+	}
+	return ErrNone;
+}
+REG_PARSE(Trades,"[Power]");
+
+static std::string cardList(const Hand &hand)
+{
+	std::string list;
+	BOOST_FOREACH(auto card, hand)
+		list += (list.empty()?"":",") + card->_name;
+	return list;
+}
+
+int parseOffer(const std::vector<std::string> &names, Game &g, std::ostream &out)
+{
+	if (names.size() < 4)
+		return parseHelpC(names, g, out);
+
+	auto power = g.FindPower(names[1]);
+	if (power == g._powers.end())
+		return ErrPowerNotFound;
+
+	Hand gives, wants;
+	Hand *side = &gives;
+	for(int i = 2; i < names.size(); ++i)
+	{
+		if (boost::iequals(names[i], "for") && side == &gives)
+		{
+			side = &wants;
+			continue;
+		}
+		CardP card = g.FindCard(names[i]);
+		if (!card)
+			return ErrCardNotFound;
+		side->insert(card);
+	}
+	// Same minimum as a trade
+	if (gives.size() < 3 || wants.empty())
+		return parseHelpC(names, g, out);
+	if (!power->first->Has(gives))
+		return ErrCardNotFound;
+
+	const int id = g._offers.Post(power->first, gives, wants);
+	g._undo.Post(g._offers.Find(id), 1);
+	if (Structured())
+		RecordWriter(out).Record("offer")
+			.Field("id", id)
+			.Field("power", power->first->_name)
+			.Field("gives", cardList(gives))
+			.Field("wants", cardList(wants));
+	else
+		out << "Offer " << id << std::endl;
+	return ErrNone;
+}
+REG_PARSE(Offer,"Power Card Card Card ... For Card ...");
+REG_MUTATES(Offer);
+
+int parseOffers(const std::vector<std::string> &names, Game &g, std::ostream &out)
+{
+	if (names.size() > 2)
+		return parseHelpC(names, g, out);
+
+	PowerP power;
+	if (names.size() == 2)
+	{
+		auto found = g.FindPower(names[1]);
+		if (found == g._powers.end())
+			return ErrPowerNotFound;
+		power = found->first;
+	}
+
+	RecordWriter w(out);
+	BOOST_FOREACH(auto &i, g._offers._offers)
+	{
+		const Offer &offer = *i.second;
+		if (power && offer._power != power)
+			continue;
+		// Cards traded or spent since the offer was posted
+		const bool held = offer._power->Has(offer._gives);
+		if (Structured())
+		{
+			w.Record("offer")
+				.Field("id", offer._id)
+				.Field("power", offer._power->_name)
+				.Field("gives", cardList(offer._gives))
+				.Field("wants", cardList(offer._wants))
+				.Field("held", held?1:0);
+			continue;
+		}
+		out << offer._id << ". " << offer._power->_name << " gives " << cardList(offer._gives)
+			<< " for " << cardList(offer._wants) << (held?"":" (no longer held)") << std::endl;
+	}
+	return ErrNone;
+}
+REG_PARSE(Offers,"[Power]");
+
+int parseWithdraw(const std::vector<std::string> &names, Game &g, std::ostream &out)
+{
+	if (names.size() < 2)
+		return parseHelpC(names, g, out);
+
+	// Every id is checked first so a bad one leaves the book as it was
+	std::map<int, OfferP> offers;
+	for(int i = 1; i < names.size(); ++i)
+	{
+		int id;
+		if (!readCount(names[i], id))
+			return ErrUnableToParse;
+		OfferP offer = g._offers.Find(id);
+		if (!offer)
+			return ErrUnableToParse;
+		offers[offer->_id] = offer;
+	}
+	BOOST_FOREACH(auto &i, offers)
+	{
+		g._offers.Withdraw(i.first);
+		g._undo.Post(i.second, -1);
+	}
+	return ErrNone;
+}
+REG_PARSE(Withdraw,"#Offer ...");
+REG_MUTATES(Withdraw);
+
+int parseMatch(const std::vector<std::string> &names, Game &g, std::ostream &out)
+{
+	if (names.size() != 1)
+		return parseHelpC(names, g, out);
+
+	std::vector<Cycle> settled;
+	MatchOffers(g, settled);
+
+	RecordWriter w(out);
+	for(int c = 0; c < settled.size(); ++c)
+	{
+		const Cycle &cycle = settled[c];
+		for(int i = 0; i < cycle.size(); ++i)
+		{
+			const Offer &offer = *cycle[i];
+			const Offer &to = *cycle[(i+1)%cycle.size()];
+			if (Structured())
+				w.Record("settled")
+					.Field("trade", c+1)
+					.Field("offer", offer._id)
+					.Field("from", offer._power->_name)
+					.Field("to", to._power->_name)
+					.Field("cards", cardList(offer._gives));
+			else
+				out << offer._power->_name << " gives " << to._power->_name << ": " << cardList(offer._gives) << std::endl;
+		}
+		if (!Structured())
+			out << std::endl;
+	}
+	if (!Structured() && settled.empty())
+		out << "No offers match" << std::endl;
+	return ErrNone;
+}
+REG_PARSE(Match,"");
+REG_MUTATES(Match);
 /*
 bool loadHelpText(HelpText &ht)
 {
@@ -822,7 +1419,7 @@ int parseShuffleIn(const std::vector<std::string> &names, Game &g, std::ostream
 			break;
 	}
 
-	g._cards.insert(card);
+	g.AddCard(card);
 
 	Deck &deck = g._decks[card->_deck];
 	for(int i = 0; i < card->_maxCount; ++i)
@@ -831,11 +1428,13 @@ int parseShuffleIn(const std::vector<std::string> &names, Game &g, std::ostream
 		int location = maxCount?CivRand(maxCount):0;
 		out << "Inserting (" << card->_deck << ")(" << card->_type << ")(" << card->_maxCount << ")(" << card->_name << ") at "<< location << std::endl;
 		deck.insert(deck.begin()+location, card);
+		g._ledger.Add(card, CardLedger::Location(CardLedger::InDeck, card->_deck));
 	}
 	
 	return ErrNone;
 }
 REG_PARSE(ShuffleIn,"deck type maxCount cardName");
+REG_MUTATES(ShuffleIn);
 
 int parseRandom(const std::vector<std::string> &names, Game &g, std::ostream &out)
 {
@@ -846,21 +1445,174 @@ int parseRandom(const std::vector<std::string> &names, Game &g, std::ostream &ou
 	return ErrNone;
 }
 REG_PARSE(Random, "max");
+REG_MUTATES(Random); // Advances the session generator, replays need it
 
 int parseReshuffle(const std::vector<std::string> &names, Game &g, std::ostream &out)
 {
 	if (names.size() != 1)
 		return parseHelpC(names, g, out);
 
-	for(int i = 0; i < g._discards.size(); ++i)
+	ReshuffleDecks(g);
+
+	return ErrNone;
+}
+REG_PARSE(Reshuffle,"");
+REG_MUTATES(Reshuffle);
+
+// End of turn in one pass: in AST order every power discards its calamities,
+// the discards are shuffled into the decks, then every power draws
+int parseTurn(const std::vector<std::string> &names, Game &g, std::ostream &out)
+{
+	if (names.size() < 2 || names.size()%2)
+		return parseHelpC(names, g, out);
+
+	// Everything is checked before the first discard.  A power draws one
+	// card from each deck numbered 1 to its count, so no count may reach
+	// past the last deck.
+	const int decks = g._decks.size();
+	int numCards;
+	if (!readCount(names[1], numCards) || numCards >= decks)
+		return ErrUnableToParse;
+	std::map<Power *, int> draws;
+	for(int i = 2; i < names.size(); i += 2)
+	{
+		Powers::iterator power = g.FindPower(names[i]);
+		if (power == g._powers.end())
+			return ErrPowerNotFound;
+		int &count = draws[power->first.get()];
+		if (!readCount(names[i+1], count) || count >= decks)
+			return ErrUnableToParse;
+	}
+
+	std::vector<Hand> tossed(g._powers.size());
+	std::vector<Hand> drawn(g._powers.size());
+
+	int p = 0;
+	BOOST_FOREACH(auto power, g._powers)
+	{
+		FillCalamities(g, *power.first, tossed[p]);
+		power.first->Remove(tossed[p]);
+		MergeDiscards(g, tossed[p]);
+		++p;
+	}
+
+	ReshuffleDecks(g);
+
+	p = 0;
+	BOOST_FOREACH(auto power, g._powers)
 	{
-		ShuffleIn(g._decks[i], g._discards[i]);
-		g._discards[i].clear();
+		auto count = draws.find(power.first.get());
+		DrawCards(g, drawn[p], count == draws.end()?numCards:count->second);
+		power.first->Add(drawn[p]);
+		++p;
 	}
 
+	if (Structured())
+	{
+		RecordWriter w(out);
+		p = 0;
+		BOOST_FOREACH(auto power, g._powers)
+		{
+			WriteHand(w, "discarded", "power", power.first->_name, tossed[p]);
+			WriteHand(w, "drawn", "power", power.first->_name, drawn[p]);
+			++p;
+		}
+		return ErrNone;
+	}
+
+	p = 0;
+	BOOST_FOREACH(auto power, g._powers)
+	{
+		out << power.first->_name << std::endl;
+		out << "Discarded:" << std::endl;
+		RenderHand(out, tossed[p]);
+		out << "Drawn:" << std::endl;
+		RenderHand(out, drawn[p]);
+		out << std::endl;
+		++p;
+	}
 	return ErrNone;
 }
-REG_PARSE(Reshuffle,"");
+REG_PARSE(Turn,"#Cards [Power #Cards] ...");
+REG_MUTATES(Turn);
+
+// Where every copy of a card is, or without a card every card whose copies
+// don't add up to its count
+int parseWhere(const std::vector<std::string> &names, Game &g, std::ostream &out)
+{
+	if (names.size() > 2)
+		return parseHelpC(names, g, out);
+
+	if (names.size() == 1)
+	{
+		std::vector<std::pair<CardP, int> > unbalanced;
+		FindUnbalanced(g, unbalanced);
+		if (Structured())
+		{
+			RecordWriter w(out);
+			BOOST_FOREACH(auto i, unbalanced)
+				w.Record("unbalanced").Field("card", i.first->_name).Field("count", i.second).Field("max", i.first->_maxCount);
+			return ErrNone;
+		}
+		if (unbalanced.empty())
+			out << "All " << g._cardIds.size() << " cards accounted for" << std::endl;
+		BOOST_FOREACH(auto i, unbalanced)
+			out << i.first->_name << '\t' << i.second << " of " << i.first->_maxCount << std::endl;
+		return ErrNone;
+	}
+
+	CardP card = g.FindCard(names[1]);
+	if (!card)
+		return ErrCardNotFound;
+
+	if (Structured())
+	{
+		RecordWriter w(out);
+		BOOST_FOREACH(auto i, g._ledger.Find(card))
+		{
+			w.Record("where").Field("card", card->_name)
+				.Field("place", PlaceName(i.first._kind))
+				.Field("owner", LocationOwner(g, i.first))
+				.Field("count", i.second);
+		}
+		w.Record("total").Field("card", card->_name).Field("count", g._ledger.Total(card)).Field("max", card->_maxCount);
+		return ErrNone;
+	}
+
+	BOOST_FOREACH(auto i, g._ledger.Find(card))
+		out << PlaceName(i.first._kind) << ' ' << LocationOwner(g, i.first) << '\t' << i.second << std::endl;
+	out << "Total\t" << g._ledger.Total(card) << " of " << card->_maxCount << std::endl;
+	return ErrNone;
+}
+REG_PARSE(Where,"[Card]");
+
+int parseCheck(const std::vector<std::string> &names, Game &g, std::ostream &out)
+{
+	if (names.size() != 1)
+		return parseHelpC(names, g, out);
+
+	if (Structured())
+	{
+		std::vector<Discrepancy> problems;
+		FindCardProblems(g, problems);
+		FindScoreProblems(g, problems);
+		RecordWriter w(out);
+		BOOST_FOREACH(auto &d, problems)
+		{
+			w.Record("problem").Field("name", d._name)
+				.Field("kind", d._kind)
+				.Field("kept", d._kept)
+				.Field("actual", d._actual);
+		}
+		return ErrNone;
+	}
+
+	if (!CheckCards(g, out))
+		out << "All " << g._cardIds.size() << " cards accounted for" << std::endl;
+	CheckScores(g, out);
+	return ErrNone;
+}
+REG_PARSE(Check,"");
 
 int parseValue(const std::vector<std::string> &names, Game &g, std::ostream &out)
 {
@@ -881,6 +1633,13 @@ int parseValue(const std::vector<std::string> &names, Game &g, std::ostream &out
 	}
 
 	int v = ValueHand(h);
+	if (Structured())
+	{
+		RecordWriter w(out);
+		WriteHand(w, "card", "", "", h);
+		w.Record("value").Field("value", v).Field("tokens", tokens).Field("total", v+tokens);
+		return ErrNone;
+	}
 	RenderHand(out, h);
 	out << v << '+' << tokens << " = " << v+tokens << std::endl;
 	return ErrNone;
@@ -892,10 +1651,18 @@ int parseList(const std::vector<std::string> &names, Game &g, std::ostream &out)
 	if (names.size() != 2 && names.size() != 3)
 		return parseHelpC(names, g, out);
 
+	// Each branch goes over the game once and writes every row either way
+	const bool records = Structured();
+	RecordWriter w(out);
 	if (boost::iequals(names[1],"powers"))
 	{
 		BOOST_FOREACH(auto i, g._powers)
 		{
+			if (records)
+			{
+				WriteHand(w, "held", "power", i.first->_name, i.first->_hand);
+				continue;
+			}
 			out << i.first->_name << '\t';
 			BOOST_FOREACH(auto j, i.first->_hand)
 			{
@@ -909,6 +1676,15 @@ int parseList(const std::vector<std::string> &names, Game &g, std::ostream &out)
 	{
 		BOOST_FOREACH(auto i, g._powers)
 		{
+			if (records)
+			{
+				w.Record("player").Field("power", i.first->_name);
+				if (i.second)
+					w.Field("player", i.second->_name)
+						.Field("password", i.second->_password)
+						.Field("email", i.second->_email);
+				continue;
+			}
 			out << i.first->_name << '\t';
 			if (i.second)
 				out << i.second->_name  << "\t'" << i.second->_password << "'\t'" << i.second->_email << "'"; 
@@ -920,40 +1696,46 @@ int parseList(const std::vector<std::string> &names, Game &g, std::ostream &out)
 	{
 		for(int i = 1; i < g._decks.size(); ++i)
 		{
-			out << i << '\t';
-			BOOST_FOREACH(auto j, g._decks[i])
+			if (!records)
+				out << i << '\t';
+			for(int j = 0; j < g._decks[i].size(); ++j)
 			{
-				out << j->_name << ',';
+				if (records)
+					w.Record("deck").Field("deck", i).Field("position", j).Field("card", g._decks[i][j]->_name);
+				else
+					out << g._decks[i][j]->_name << ',';
 			}
-			out << std::endl;
+			if (!records)
+				out << std::endl;
 		}
 		return ErrNone;
 	}
 	if (boost::icontains(names[1],"discard"))
 	{
 		for(int i = 1; i < g._discards.size(); ++i)
-	        {
-		        out << i << ": ";
-	                RenderHand(out, g._discards[i]);
-	        }
-	        return ErrNone;
-        }
-	if (boost::icontains(names[1],"calamities"))
-	{
-		typedef std::multimap<CardP, PowerP, CardCompare> RevMap;
-		RevMap calamities;
-		BOOST_FOREACH(auto i, g._powers)
 		{
-			BOOST_FOREACH(auto j, i.first->_hand)
+			const std::string pile = boost::lexical_cast<std::string>(i);
+			if (records)
 			{
-				if (j->_type != Card::Normal)
-					calamities.insert(std::make_pair(j,i.first));
+				WriteHand(w, "discard", "pile", pile, g._discards[i]);
+				continue;
 			}
+			out << pile << ": ";
+			RenderHand(out, g._discards[i]);
 		}
+		return ErrNone;
+	}
+	if (boost::icontains(names[1],"calamities"))
+	{
+		std::vector<std::pair<CardP, PowerP> > calamities;
+		HeldCalamities(g, calamities);
 
 		BOOST_FOREACH(auto i, calamities)
 		{
-			out << i.first->_name << ": " << i.second->_name << std::endl;
+			if (records)
+				w.Record("calamity").Field("card", i.first->_name).Field("power", i.second->_name);
+			else
+				out << i.first->_name << ": " << i.second->_name << std::endl;
 		}
 		return ErrNone;
 	}
@@ -962,18 +1744,24 @@ int parseList(const std::vector<std::string> &names, Game &g, std::ostream &out)
 	{
 		BOOST_FOREACH(auto power, g._powers)
 		{
+			if (!power.first->Score()._evil)
+				continue;
 			bool output = false;
 			BOOST_FOREACH(auto card, power.first->_civCards._cards)
 			{
-				if (card->_evil)
+				if (!card->_evil)
+					continue;
+				if (records)
+				{
+					w.Record("evil").Field("power", power.first->_name).Field("civcard", card->_name);
+					continue;
+				}
+				if (!output)
 				{
-					if (!output)
-					{
-						out << power.first->_name << ": ";
-						output = true;
-					}
-					out << card->_name << ' ';	
+					out << power.first->_name << ": ";
+					output = true;
 				}
+				out << card->_name << ' ';	
 			}
 			if (output)
 				out << std::endl;
@@ -984,14 +1772,17 @@ int parseList(const std::vector<std::string> &names, Game &g, std::ostream &out)
 	{
 		BOOST_FOREACH(auto power, g._powers)
 		{
-			std::vector<std::pair<std::string,int>> points;
-			points = CountPoints(g, *power.first);
-			out << power.first->_name << ": ";
-			BOOST_FOREACH(auto t, points)
+			if (!records)
+				out << power.first->_name << ": ";
+			BOOST_FOREACH(auto t, CountPoints(g, *power.first))
 			{
-				out << t.first << '=' << t.second << ' ';
+				if (records)
+					w.Record("points").Field("power", power.first->_name).Field("category", t.first).Field("points", t.second);
+				else
+					out << t.first << '=' << t.second << ' ';
 			}
-			out << std::endl;
+			if (!records)
+				out << std::endl;
 		}
 		return ErrNone;
 	}
@@ -1009,6 +1800,106 @@ int parseList(const std::vector<std::string> &names, Game &g, std::ostream &out)
 }
 REG_PARSE(List,"powers/players/decks/discard/calamities/evil");
 
+// Every power's hand value and civ points from one table, by power id
+static void countValues(const Game &g, std::vector<int> &values, std::vector<int> &points)
+{
+	const ScoreTable table(g);
+	table.HandValues(values);
+	if (g.Rules())
+		table.CivPoints(*g.Rules(), points);
+	else
+		points.assign(values.size(), 0);
+}
+
+// Counts by power or deck, written as one record each or as a table that
+// by default ends with the column totals.  Text keeps the layout each count
+// printed before records existed.
+class CountTable
+{
+	public:
+		enum Totals
+		{
+			ColumnTotals,
+			GrandTotal, // Both columns summed into one
+			NoTotal,
+		};
+
+		CountTable(const std::string &type, const std::string &key, const std::string &field, const std::string &second = ""):
+			_type(type), _key(key), _field(field), _second(second), _separator("\t"), _totals(ColumnTotals)
+		{}
+
+		CountTable &Text(const std::string &separator, Totals totals)
+		{
+			_separator = separator;
+			_totals = totals;
+			return *this;
+		}
+
+		void Row(const std::string &name, int count, int second = 0)
+		{
+			const Entry e = {name, -1, count, second};
+			_rows.push_back(e);
+		}
+		void Row(int deck, int count)
+		{
+			const Entry e = {boost::lexical_cast<std::string>(deck), deck, count, 0};
+			_rows.push_back(e);
+		}
+
+		int Render(std::ostream &out) const
+		{
+			if (Structured())
+			{
+				RecordWriter w(out);
+				BOOST_FOREACH(auto &i, _rows)
+				{
+					w.Record(_type);
+					if (i._deck < 0)
+						w.Field(_key, i._name);
+					else
+						w.Field(_key, i._deck);
+					w.Field(_field, i._count);
+					if (!_second.empty())
+						w.Field(_second, i._second);
+				}
+				return ErrNone;
+			}
+			int count = 0, second = 0;
+			BOOST_FOREACH(auto &i, _rows)
+			{
+				out << i._name << _separator << i._count;
+				if (!_second.empty())
+					out << '\t' << i._second;
+				out << std::endl;
+				count += i._count;
+				second += i._second;
+			}
+			if (_totals == GrandTotal)
+				out << "Total:\t" << count+second << std::endl;
+			else if (_totals == ColumnTotals)
+			{
+				out << "Total:\t" << count;
+				if (!_second.empty())
+					out << '\t' << second;
+				out << std::endl;
+			}
+			return ErrNone;
+		}
+
+	private:
+		struct Entry
+		{
+			std::string _name;
+			int _deck; // -1 when counting by name
+			int _count;
+			int _second;
+		};
+		std::string _type, _key, _field, _second;
+		std::string _separator;
+		Totals _totals;
+		std::vector<Entry> _rows;
+};
+
 int parseCount(const std::vector<std::string> &names, Game &g, std::ostream &out)
 {
 	if (names.size() != 2)
@@ -1016,34 +1907,23 @@ int parseCount(const std::vector<std::string> &names, Game &g, std::ostream &out
 
 	if (boost::iequals(names[1],"calamities"))
 	{
-		int bigCount(0); 
+		CountTable table("calamities", "power", "major", "minor");
+		table.Text("\t", CountTable::GrandTotal);
 		BOOST_FOREACH(auto i, g._powers)
 		{
-			int count(0);
-			int smallCount(0);
-			BOOST_FOREACH(auto j, i.first->_hand)
-			{
-				if (j->_type != Card::Normal)
-					++count;
-				if (j->_type == Card::Minor)
-					++smallCount;
-			}
-			out << i.first->_name << '\t' << count-smallCount << '\t' << smallCount << std::endl;
-			bigCount+=count;
+			const Scoreboard &score = i.first->Score();
+			table.Row(i.first->_name, score._calamities-score._minorCalamities, score._minorCalamities);
 		}
-		out << "Total:\t" << bigCount << std::endl;
-		return ErrNone;
+		return table.Render(out);
 	}
 	if (boost::iequals(names[1],"powers"))
 	{
-		int bigCount(0);
+		CountTable table("cards", "power", "count");
 		BOOST_FOREACH(auto i, g._powers)
 		{
-			out << i.first->_name << '\t' << i.first->_hand.size() << std::endl;
-			bigCount += i.first->_hand.size();
+			table.Row(i.first->_name, i.first->_hand.size());
 		}
-		out << "Total:\t" << bigCount << std::endl;
-		return ErrNone;
+		return table.Render(out);
 	}
 	if (boost::iequals(names[1],"players"))
 	{
@@ -1053,68 +1933,69 @@ int parseCount(const std::vector<std::string> &names, Game &g, std::ostream &out
 			if (i.second)
 				++count;
 		}
-		out << "Assigned Player: " << count << std::endl;
+		if (Structured())
+			RecordWriter(out).Record("players").Field("count", count);
+		else
+			out << "Assigned Player: " << count << std::endl;
 		return ErrNone;
 	}
 	if (boost::iequals(names[1],"decks"))
 	{
-		int bigCount(0);
+		CountTable table("deck", "deck", "count");
 		for(int i = 1; i < g._decks.size(); ++i)
 		{
-			out << i << '\t' << g._decks[i].size() << std::endl;
-			bigCount += g._decks[i].size();
+			table.Row(i, g._decks[i].size());
 		}
-		out << "Total:\t" << bigCount << std::endl;
-		return ErrNone;
+		return table.Render(out);
 	}
 	if (boost::iequals(names[1],"discards"))
 	{
-		int bigCount(0);
+		CountTable table("discard", "deck", "count");
 		for(int i = 1; i < g._discards.size(); ++i)
 		{
-			out << i << '\t' << g._discards[i].size() << std::endl;
-			bigCount += g._discards[i].size();
+			table.Row(i, g._discards[i].size());
 		}
-		out << "Total:\t" << bigCount << std::endl;
-		return ErrNone;
+		return table.Render(out);
 	}
 	if (boost::iequals(names[1],"evil"))
 	{
-		int bigCount(0);
+		CountTable table("evil", "power", "count");
 		BOOST_FOREACH(auto i, g._powers)
 		{
-			int count(0);
-			BOOST_FOREACH(auto j, i.first->_civCards._cards)
-			{
-				if (j->_evil)
-					++count;
-			}
-			out << i.first->_name << '\t' << count << std::endl;
-			bigCount+=count;
+			table.Row(i.first->_name, i.first->Score()._evil);
 		}
-		out << "Total:\t" << bigCount << std::endl;
-		return ErrNone;
+		return table.Render(out);
 	}
 	if (boost::iequals(names[1],"points"))
 	{
+		CountTable table("points", "power", "points");
+		table.Text(": ", CountTable::NoTotal);
 		BOOST_FOREACH(auto power, g._powers)
 		{
-			std::vector<std::pair<std::string,int>> points;
-			points = CountPoints(g, *power.first);
-			out << power.first->_name << ": ";
 			int total = 0;
-			BOOST_FOREACH(auto t, points)
+			BOOST_FOREACH(auto t, CountPoints(g, *power.first))
 			{
 				total += t.second;
 			}
-			out << total;
-			out << std::endl;
+			table.Row(power.first->_name, total);
 		}
-		return ErrNone;
+		return table.Render(out);
+	}
+	if (boost::iequals(names[1],"values"))
+	{
+		std::vector<int> values, points;
+		countValues(g, values, points);
+		CountTable table("value", "power", "hand", "civ");
+		BOOST_FOREACH(auto power, g._powers)
+		{
+			const int id = power.first->Id();
+			table.Row(power.first->_name, values[id], points[id]);
+		}
+		return table.Render(out);
 	}
 	return ErrUnableToParse;
 }
-REG_PARSE(Count,"powers/players/decks/discard/calamities");
+REG_PARSE(Count,"powers/players/decks/discard/calamities/values");
 
 bool splitLine(const std::string &line, std::vector<std::string> &target)
 {
@@ -1136,6 +2017,26 @@ bool splitLine(const std::string &line, std::vector<std::string> &target)
 	return true;
 }
 
+static bool s_fileOutput = true;
+
+void SetFileOutput(bool on)
+{
+	s_fileOutput = on;
+}
+
+bool FileOutput()
+{
+	return s_fileOutput;
+}
+
+bool Mutates(const std::string &line)
+{
+	std::vector<std::string> target;
+	if (!splitLine(line, target) || target.empty())
+		return false;
+	return MutateFactory::get_const_instance().Exists(target[0]);
+}
+
 int ParseLine(const std::string &line, Game &g, std::ostream &out)
 {
 	const Parser &p = ParseFactory::get_const_instance();
@@ -1144,7 +2045,21 @@ int ParseLine(const std::string &line, Game &g, std::ostream &out)
 		return ErrUnableToParse;
 
 	if (p.Exists(target[0]))
-		return p[target[0]](target, g, out);
+	{
+		const Command c = p[target[0]];
+		ScopedStats stats(*c._stats);
+		const long imbalance = g._ledger.Imbalance();
+		g._undo.Begin(line);
+		const int error = c._parse(target, g, out);
+		g._undo.End();
+		// Every command leaves each card with as many copies as it found
+		if (g._ledger.Imbalance() != imbalance)
+		{
+			std::cerr << "Card counts changed by: " << line << std::endl;
+			CheckCards(g, std::cerr);
+		}
+		return error;
+	}
 	else
 		return ErrUnableToParse;
 }
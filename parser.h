@@ -5,5 +5,10 @@
 
 bool splitLine(const std::string &line, std::vector<std::string> &target);
 int ParseLine(const std::string &line, Game &g, std::ostream &out);
+bool Mutates(const std::string &line);
+// Off while replaying: commands still change the game as they did but
+// write no files outside it
+void SetFileOutput(bool on);
+bool FileOutput();
 
 #endif
@@ -0,0 +1,461 @@
+#include "plan.h"
+#include "rules.h"
+
+#include <boost/foreach.hpp>
+
+#include <algorithm>
+#include <bitset>
+#include <unordered_map>
+
+namespace
+{
+	const int MaxCandidates = 128;
+	const int MaxSets = 1<<18; // Searched before settling for the best so far
+	const int MaxExact = 24; // Up to this many candidates every set is costed, 2 bytes each
+	typedef std::bitset<MaxCandidates> Set;
+
+	// An affordable set and the order it was bought in
+	struct Found
+	{
+		Set _set;
+		int _cost;
+		int _points;
+		std::vector<int> _order;
+	};
+
+	class Planner
+	{
+		public:
+			Planner(const Game &g, const Power &p, int budget, int count);
+			bool Run(std::vector<Purchase> &plans);
+
+		private:
+			int Price(int card) const;
+			void Buy(int card, int sign);
+			int Bound(const Set &bought, int cost, int points) const;
+			bool Prune(int bound, int cost) const;
+			void Offer(const Set &bought, int cost, int points);
+			void Search(const Set &bought, int cost, int points);
+			bool Complete(const Set &bought, int cost, int points);
+			void Exact();
+			void Order(const std::vector<unsigned short> &lowest, Found &found);
+
+			int _budget;
+			int _count;
+			std::vector<CivCardP> _cards;
+			std::vector<int> _points;
+			std::vector<int> _base; // Cost less the credits the portfolio gives
+			std::vector<std::vector<int> > _credits; // [from][to] card credits between candidates
+			int _groupCredits[CivCard::GroupSize]; // What the portfolio and the cards bought give
+			std::vector<int> _cardCredits; // Per candidate, from the cards bought
+			std::vector<int> _byRatio; // Candidates by points per cheapest price
+			std::vector<int> _cheapest;
+
+			std::unordered_map<Set, int> _seen; // Lowest cost each set was searched at
+			std::vector<int> _path;
+			std::vector<Found> _best;
+			bool _stopped;
+	};
+
+	Planner::Planner(const Game &g, const Power &p, int budget, int count):_budget(budget),_count(count),_stopped(false)
+	{
+		const CivPortfolio &portfolio = p._civCards;
+		std::copy(portfolio._bonusCredits.begin(), portfolio._bonusCredits.end(), _groupCredits);
+		BOOST_FOREACH(auto owned, portfolio._cards)
+		{
+			for(int i = 0; i < CivCard::GroupSize; ++i)
+				_groupCredits[i] += owned->_groupCredits[i];
+		}
+
+		BOOST_FOREACH(auto card, g._civcards)
+		{
+			if (_cards.size() == MaxCandidates)
+				break;
+			if (portfolio._cards.count(card))
+				continue;
+			_cards.push_back(card);
+			_points.push_back(g.Rules()->CivPoints(card->_cost));
+			int base = card->_cost;
+			BOOST_FOREACH(auto owned, portfolio._cards)
+			{
+				auto credit = owned->_cardCredits.find(card);
+				if (credit != owned->_cardCredits.end())
+					base -= credit->second;
+			}
+			_base.push_back(base);
+		}
+
+		const int n = _cards.size();
+		_cardCredits.assign(n, 0);
+		_credits.assign(n, std::vector<int>(n));
+		for(int from = 0; from < n; ++from)
+		{
+			for(int to = 0; to < n; ++to)
+			{
+				auto credit = _cards[from]->_cardCredits.find(_cards[to]);
+				if (credit != _cards[from]->_cardCredits.end())
+					_credits[from][to] = credit->second;
+			}
+		}
+
+		// Every candidate bought first gives each card its lowest possible price
+		for(int i = 0; i < n; ++i)
+			Buy(i, 1);
+		for(int i = 0; i < n; ++i)
+			_cheapest.push_back(Price(i));
+		for(int i = 0; i < n; ++i)
+			Buy(i, -1);
+
+		for(int i = 0; i < n; ++i)
+			_byRatio.push_back(i);
+		std::sort(_byRatio.begin(), _byRatio.end(), [this](int l, int r)
+		{
+			// points/price descending without dividing by a zero price
+			return _points[l]*std::max(_cheapest[r], 1) > _points[r]*std::max(_cheapest[l], 1);
+		});
+	}
+
+	// Same as CivPortfolio::Cost with the cards bought so far held
+	int Planner::Price(int card) const
+	{
+		int group = 0;
+		for(int i = 0; i < CivCard::GroupSize; ++i)
+		{
+			if (_cards[card]->_groups[i])
+				group = std::max(group, _groupCredits[i]);
+		}
+		return std::max(_base[card]-_cardCredits[card]-group, 0);
+	}
+
+	// Adds the credits of a card bought, sign -1 takes them back
+	void Planner::Buy(int card, int sign)
+	{
+		for(int i = 0; i < CivCard::GroupSize; ++i)
+			_groupCredits[i] += sign*_cards[card]->_groupCredits[i];
+		for(int i = 0; i < _cards.size(); ++i)
+			_cardCredits[i] += sign*_credits[card][i];
+	}
+
+	// Most points any set containing bought can reach: the rest of the budget
+	// spent greedily on the best points per lowest price, the last card in part
+	int Planner::Bound(const Set &bought, int cost, int points) const
+	{
+		int left = _budget-cost;
+		BOOST_FOREACH(auto i, _byRatio)
+		{
+			if (bought[i])
+				continue;
+			if (_cheapest[i] <= left)
+			{
+				left -= _cheapest[i];
+				points += _points[i];
+				continue;
+			}
+			points += (_points[i]*left + _cheapest[i]-1)/_cheapest[i];
+			break;
+		}
+		return points;
+	}
+
+	bool better(const Found &l, const Found &r)
+	{
+		if (l._points != r._points)
+			return l._points > r._points;
+		return l._cost < r._cost;
+	}
+
+	// No set grown from one with this bound and cost can make the list
+	bool Planner::Prune(int bound, int cost) const
+	{
+		if (_best.size() < _count)
+			return false;
+		const Found &last = _best.back();
+		return bound < last._points || (bound == last._points && cost >= last._cost);
+	}
+
+	void Planner::Offer(const Set &bought, int cost, int points)
+	{
+		BOOST_FOREACH(auto &found, _best)
+		{
+			if (found._set != bought)
+				continue;
+			if (cost < found._cost)
+			{
+				found._cost = cost;
+				found._order = _path;
+				std::stable_sort(_best.begin(), _best.end(), better);
+			}
+			return;
+		}
+		const Found entry = {bought, cost, points, _path};
+		if (_best.size() == _count && !better(entry, _best.back()))
+			return;
+		_best.insert(std::upper_bound(_best.begin(), _best.end(), entry, better), entry);
+		if (_best.size() > _count)
+			_best.pop_back();
+	}
+
+	// Depth first, most points per price first so good sets are found early
+	// and bound the rest.  A set reached again no cheaper than before has
+	// nothing new to offer.
+	void Planner::Search(const Set &bought, int cost, int points)
+	{
+		const int n = _cards.size();
+		if (_stopped || Prune(Bound(bought, cost, points), cost))
+			return;
+
+		int least = 0;
+		std::vector<std::pair<int, int> > next; // Price and card
+		for(int c = 0; c < n; ++c)
+		{
+			if (bought[c])
+				continue;
+			least += _cheapest[c];
+			const int price = Price(c);
+			if (cost+price <= _budget)
+				next.push_back(std::make_pair(price, c));
+		}
+		if (next.empty())
+		{
+			if (bought.any())
+				Offer(bought, cost, points);
+			return;
+		}
+		if (least <= _budget-cost && Complete(bought, cost, points))
+			return;
+
+		std::sort(next.begin(), next.end(), [this](const std::pair<int, int> &l, const std::pair<int, int> &r)
+		{
+			return _points[l.second]*std::max(r.first, 1) > _points[r.second]*std::max(l.first, 1);
+		});
+		BOOST_FOREACH(auto &i, next)
+		{
+			const int price = i.first;
+			const int c = i.second;
+
+			Set grown(bought);
+			grown.set(c);
+			auto seen = _seen.find(grown);
+			if (seen != _seen.end() && seen->second <= cost+price)
+				continue;
+			_seen[grown] = cost+price;
+			if (_seen.size() == MaxSets)
+				_stopped = true;
+
+			_path.push_back(c);
+			Buy(c, 1);
+			Search(grown, cost+price, points+_points[c]);
+			Buy(c, -1);
+			_path.pop_back();
+		}
+	}
+
+	// Buys the rest of the cards cheapest first, true when that is affordable
+	// so all of them is the only set worth having
+	bool Planner::Complete(const Set &bought, int cost, int points)
+	{
+		const int n = _cards.size();
+		const size_t depth = _path.size();
+		Set all(bought);
+		while(all.count() < n && cost <= _budget)
+		{
+			int cheapest = -1;
+			for(int c = 0; c < n; ++c)
+			{
+				if (!all[c] && (cheapest < 0 || Price(c) < Price(cheapest)))
+					cheapest = c;
+			}
+			cost += Price(cheapest);
+			points += _points[cheapest];
+			all.set(cheapest);
+			_path.push_back(cheapest);
+			Buy(cheapest, 1);
+		}
+		const bool affordable = cost <= _budget;
+		if (affordable)
+			Offer(all, cost, points);
+		for(size_t i = depth; i < _path.size(); ++i)
+			Buy(_path[i], -1);
+		_path.resize(depth);
+		return affordable;
+	}
+
+	// Every set's lowest cost, by set as a bit mask.  A set's cheapest order
+	// ends with some card bought after the cheapest order of the rest, so
+	// going through the sets in increasing order and pricing each card not
+	// yet in them gives every set its lowest cost before it is reached.
+	void Planner::Exact()
+	{
+		const int n = _cards.size();
+		const unsigned sets = 1u << n;
+		const unsigned short unaffordable = 0xffff;
+		if (_budget >= unaffordable)
+		{
+			Search(Set(), 0, 0);
+			return;
+		}
+
+		// What each set of the low and of the high candidates gives: card
+		// credits, group credits and points.  A set's are its two halves' sums.
+		const int low = n/2;
+		const int width = n+CivCard::GroupSize+1;
+		std::vector<int> halves[2];
+		for(int h = 0; h < 2; ++h)
+		{
+			const int first = h?low:0;
+			const unsigned size = 1u << (h?n-low:low);
+			std::vector<int> &table = halves[h];
+			table.assign(size*width, 0);
+			if (!h)
+				std::copy(_groupCredits, _groupCredits+CivCard::GroupSize, table.begin()+n);
+			for(unsigned m = 1; m < size; ++m)
+			{
+				const int c = first+__builtin_ctz(m);
+				int *row = &table[m*width];
+				const int *rest = &table[(m & (m-1))*width];
+				for(int i = 0; i < n; ++i)
+					row[i] = rest[i]+_credits[c][i];
+				for(int i = 0; i < CivCard::GroupSize; ++i)
+					row[n+i] = rest[n+i]+_cards[c]->_groupCredits[i];
+				row[n+CivCard::GroupSize] = rest[n+CivCard::GroupSize]+_points[c];
+			}
+		}
+		std::vector<unsigned> groups;
+		BOOST_FOREACH(auto card, _cards)
+			groups.push_back(card->_groups.to_ulong());
+
+		std::vector<unsigned short> lowest(sets, unaffordable);
+		lowest[0] = 0;
+		// Plain pointers, this loop runs up to 2^24 times
+		unsigned short *costs = lowest.data();
+		const int *base = _base.data();
+		const unsigned *cardGroups = groups.data();
+		std::vector<unsigned> ends; // Sets nothing could be bought after
+		for(unsigned bought = 0; bought < sets; ++bought)
+		{
+			const int cost = costs[bought];
+			if (cost > _budget)
+				continue;
+			const int *lowRow = &halves[0][(bought & ((1u << low)-1))*width];
+			const int *highRow = &halves[1][(bought >> low)*width];
+
+			// Best group credit for each combination of groups a card can be in
+			int group[1 << CivCard::GroupSize];
+			group[0] = 0;
+			for(unsigned m = 1; m < (1u << CivCard::GroupSize); ++m)
+			{
+				const int i = __builtin_ctz(m);
+				group[m] = std::max(group[m & (m-1)], lowRow[n+i]+highRow[n+i]);
+			}
+
+			bool more = false;
+			const int left = _budget-cost;
+			for(unsigned rest = ~bought & (sets-1); rest; rest &= rest-1)
+			{
+				const int c = __builtin_ctz(rest);
+				int price = base[c]-lowRow[c]-highRow[c]-group[cardGroups[c]];
+				if (price > left)
+					continue;
+				more = true;
+				price = cost+std::max(price, 0);
+				unsigned short &grown = costs[bought | (1u << c)];
+				if (price < grown)
+					grown = price;
+			}
+			if (!more && bought)
+				ends.push_back(bought);
+		}
+
+		// Nothing can be bought after these, but a bigger set bought in
+		// another order may still be affordable
+		BOOST_FOREACH(auto bought, ends)
+		{
+			bool more = false;
+			for(unsigned rest = ~bought & (sets-1); rest && !more; rest &= rest-1)
+				more = costs[bought | (rest & -rest)] <= _budget;
+			if (more)
+				continue;
+
+			Set set;
+			for(int c = 0; c < n; ++c)
+				set[c] = (bought >> c) & 1;
+			const int points = halves[0][(bought & ((1u << low)-1))*width+width-1]+halves[1][(bought >> low)*width+width-1];
+			const Found entry = {set, costs[bought], points, std::vector<int>()};
+			if (_best.size() == _count && !better(entry, _best.back()))
+				continue;
+			_best.insert(std::upper_bound(_best.begin(), _best.end(), entry, better), entry);
+			if (_best.size() > _count)
+				_best.pop_back();
+		}
+		BOOST_FOREACH(auto &found, _best)
+			Order(lowest, found);
+	}
+
+	// Works back from the whole set, each time taking off a card that was
+	// bought last by some order reaching the lowest cost
+	void Planner::Order(const std::vector<unsigned short> &lowest, Found &found)
+	{
+		const int n = _cards.size();
+		unsigned bought = 0;
+		for(int c = 0; c < n; ++c)
+			bought |= unsigned(found._set.test(c)) << c;
+		found._order.clear();
+		while(bought)
+		{
+			for(int c = 0; c < n; ++c)
+			{
+				if (bought & (1u << c))
+					Buy(c, 1);
+			}
+			int last = 0;
+			for(; last < n; ++last)
+			{
+				const unsigned rest = bought & ~(1u << last);
+				if (rest == bought)
+					continue;
+				Buy(last, -1);
+				const bool cheapest = lowest[rest]+Price(last) == lowest[bought];
+				Buy(last, 1);
+				if (cheapest)
+					break;
+			}
+			for(int c = 0; c < n; ++c)
+			{
+				if (bought & (1u << c))
+					Buy(c, -1);
+			}
+			found._order.push_back(last);
+			bought &= ~(1u << last);
+		}
+		std::reverse(found._order.begin(), found._order.end());
+	}
+
+	// False when the search was cut short
+	bool Planner::Run(std::vector<Purchase> &plans)
+	{
+		if (_cards.size() <= MaxExact)
+			Exact();
+		else
+			Search(Set(), 0, 0);
+
+		BOOST_FOREACH(auto &found, _best)
+		{
+			Purchase purchase;
+			purchase._cost = found._cost;
+			purchase._points = found._points;
+			BOOST_FOREACH(auto c, found._order)
+				purchase._cards.push_back(_cards[c]);
+			plans.push_back(purchase);
+		}
+		return !_stopped;
+	}
+}
+
+bool PlanPurchases(const Game &g, const Power &p, int tokens, int count, std::vector<Purchase> &plans, bool &complete)
+{
+	if (!g.Rules())
+		return false;
+	Planner planner(g, p, tokens+p.Score()._handValue, count);
+	complete = planner.Run(plans);
+	return true;
+}
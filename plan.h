@@ -0,0 +1,26 @@
+#ifndef PLAN_H__
+#define PLAN_H__
+
+#include "db.h"
+
+#include <vector>
+
+// One set of civ cards a power can afford, in the order to buy them so each
+// card gets the credits of the ones bought before it
+struct Purchase
+{
+	std::vector<CivCardP> _cards;
+	int _cost;
+	int _points;
+};
+
+// Finds the best sets of civ cards the power doesn't hold that its hand value
+// plus tokens pays for, most points under the game's ruleset first and the
+// cheapest of equal sets first.  Only sets nothing more can be added to are
+// returned, at most count of them.  With more than 24 cards to choose from
+// large budgets can have too many sets to search them all, complete is false
+// when the best found so far are returned.
+// False when the game has no ruleset.
+bool PlanPurchases(const Game &g, const Power &p, int tokens, int count, std::vector<Purchase> &plans, bool &complete);
+
+#endif
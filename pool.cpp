@@ -0,0 +1,108 @@
+#include "pool.h"
+#include "stats.h"
+
+#include <boost/bind.hpp>
+
+#include <algorithm>
+
+// Set while a thread runs a pool's items, a ParallelFor from inside one runs
+// inline instead of waiting on a pool that may be busy with the caller
+static __thread bool t_working = false;
+
+ThreadPool::ThreadPool(int threads):_workers(std::max(threads, 1)-1),_job(NULL),_size(0),_next(0),_allocations(0),_bytes(0),_busy(0),_generation(0),_stop(false)
+{
+	for(int i = 0; i < _workers; ++i)
+		_threads.create_thread(boost::bind(&ThreadPool::Work, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		boost::mutex::scoped_lock lock(_lock);
+		_stop = true;
+	}
+	_wake.notify_all();
+	_threads.join_all();
+}
+
+void ThreadPool::RunItems(const boost::function<void (int)> &f, int n)
+{
+	const bool working = t_working;
+	t_working = true;
+	for(int i = _next++; i < n; i = _next++)
+		f(i);
+	t_working = working;
+}
+
+void ThreadPool::Work()
+{
+	unsigned seen = 0;
+	boost::mutex::scoped_lock lock(_lock);
+	while(true)
+	{
+		while(!_stop && _generation == seen)
+			_wake.wait(lock);
+		if (_stop)
+			return;
+		seen = _generation;
+		// Woke after the caller already collected every item
+		if (!_job)
+			continue;
+
+		const boost::function<void (int)> &job = *_job;
+		const int size = _size;
+		++_busy;
+		lock.unlock();
+		const unsigned long long allocations = AllocationCount();
+		const unsigned long long bytes = AllocationBytes();
+		RunItems(job, size);
+		_allocations += AllocationCount()-allocations;
+		_bytes += AllocationBytes()-bytes;
+		lock.lock();
+		if (--_busy == 0)
+			_done.notify_all();
+	}
+}
+
+void ThreadPool::ParallelFor(int n, const boost::function<void (int)> &f)
+{
+	if (n <= 0)
+		return;
+	if (_workers == 0 || n == 1 || t_working)
+	{
+		for(int i = 0; i < n; ++i)
+			f(i);
+		return;
+	}
+
+	boost::mutex::scoped_lock caller(_callers);
+	{
+		boost::mutex::scoped_lock lock(_lock);
+		_job = &f;
+		_size = n;
+		_next = 0;
+		_allocations = 0;
+		_bytes = 0;
+		++_generation;
+		++_busy;
+	}
+	_wake.notify_all();
+
+	RunItems(f, n);
+
+	boost::mutex::scoped_lock lock(_lock);
+	--_busy;
+	while(_busy)
+		_done.wait(lock);
+	_job = NULL;
+	// The workers' heap usage counts against the command that started the loop
+	ChargeAllocations(_allocations, _bytes);
+}
+
+ThreadPool &ThreadPool::Shared()
+{
+	// Never destroyed, idle workers are left blocked when the process exits
+	// rather than being joined during static destruction
+	static ThreadPool *pool = new ThreadPool(std::min<int>(std::max<int>(boost::thread::hardware_concurrency(), 1), 8));
+	return *pool;
+}
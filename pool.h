@@ -0,0 +1,46 @@
+#ifndef POOL_H__
+#define POOL_H__
+
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+#include <atomic>
+
+// Fixed set of worker threads for splitting a loop over independent items.
+// The calling thread takes part in the work, so a pool of one thread runs
+// everything inline.  A loop started from inside another one's items, on
+// any pool, also runs inline.
+class ThreadPool
+{
+	public:
+		explicit ThreadPool(int threads);
+		~ThreadPool();
+
+		// Runs f(0) .. f(n-1) and returns once all of them have finished
+		void ParallelFor(int n, const boost::function<void (int)> &f);
+		int Threads() const {return _workers+1;}
+
+		// Pool sized to the machine, shared by everything in the process
+		static ThreadPool &Shared();
+
+	private:
+		void Work();
+		void RunItems(const boost::function<void (int)> &f, int n);
+
+		int _workers;
+		boost::thread_group _threads;
+		boost::mutex _lock;
+		boost::condition_variable _wake;
+		boost::condition_variable _done;
+		const boost::function<void (int)> *_job;
+		int _size;
+		std::atomic<int> _next;
+		std::atomic<unsigned long long> _allocations; // Made by the workers on the current job
+		std::atomic<unsigned long long> _bytes;
+		int _busy;
+		unsigned _generation;
+		bool _stop;
+		boost::mutex _callers; // One ParallelFor at a time
+};
+
+#endif
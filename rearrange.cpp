@@ -26,16 +26,24 @@ bool FixDeck(Game &g, std::deque<int> &cards)
 {
 	int d = cards[0];
 	cards.pop_front();
+	if (d < 0 || d >= g._decks.size())
+		return false;
+	const long imbalance = g._ledger.Imbalance();
 	Deck deck;
 	Hand discard;
 
+	// A position listed twice would copy a card, one out of range invents one
+	std::vector<bool> kept(g._decks[d].size());
 	for(int i = 0; i < cards.size(); i++)
 	{
+		if (cards[i] < 0 || cards[i] >= kept.size() || kept[cards[i]])
+			return false;
+		kept[cards[i]] = true;
 		deck.push_back(g._decks[d][cards[i]]);	
 	}
 	for(int i = 0; i < g._decks[d].size(); i++)
 	{
-		if (std::find(cards.begin(), cards.end(), i) == cards.end())
+		if (!kept[i])
 		{
 			std::cout << "Discarding " << i << " " << g._decks[d][i]->_name << std::endl;
 			discard.insert(g._decks[d][i]);
@@ -44,7 +52,13 @@ bool FixDeck(Game &g, std::deque<int> &cards)
 
 	g._decks[d] = deck;
 	g._discards[d].insert(discard.begin(), discard.end());
+	g.Recount();
 
+	if (g._ledger.Imbalance() != imbalance)
+	{
+		CheckCards(g, std::cerr);
+		return false;
+	}
 	return true;
 }
 
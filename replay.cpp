@@ -0,0 +1,83 @@
+#include "dbUtils.h"
+#include "parser.h"
+#include "journal.h"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace fs = boost::filesystem;
+
+int main(int argc, char *argv[])
+{
+	if (argc != 3 && argc != 4)
+	{
+		std::cerr << argv[0] << " Journal Output [#Commands]" << std::endl;
+		return ErrUnableToParse;
+	}
+
+	std::ifstream in(argv[1], std::ios::binary);
+	if (!in.is_open())
+	{
+		std::cerr << "Can't open " << argv[1] << std::endl;
+		return ErrUnableToParse;
+	}
+	const std::string output(argv[2]);
+	const int limit = argc == 4?boost::lexical_cast<int>(argv[3]):-1;
+
+	std::vector<std::string> lines;
+	std::string line;
+	while(std::getline(in, line))
+	{
+		if (!line.empty())
+			lines.push_back(line);
+	}
+
+	fs::remove(output);
+	int first = 0;
+	if (lines.size() && boost::starts_with(lines[0], Journal::BaseTag))
+	{
+		fs::copy_file(boost::trim_copy(lines[0].substr(std::strlen(Journal::BaseTag))), output);
+		first = 1;
+	}
+
+	Game g(output);
+	SetFileOutput(false);
+	std::ostream discard(NULL);
+	int applied = 0;
+	std::string last;
+	for(int i = first; i < lines.size() && applied != limit; ++i)
+	{
+		if (boost::starts_with(lines[i], Journal::SeedTag))
+		{
+			Rng::Seed seed;
+			if (!SeedFromString(boost::trim_copy(lines[i].substr(std::strlen(Journal::SeedTag))), seed))
+			{
+				std::cerr << "Bad seed on line " << i+1 << std::endl;
+				g.Abandon();
+				return ErrUnableToParse;
+			}
+			SeedSession(seed);
+			continue;
+		}
+
+		++applied;
+		last = lines[i];
+		int error = ParseLine(lines[i], g, discard);
+		if (error != ErrNone)
+		{
+			std::cerr << "Error " << error << " replaying line " << i+1 << ": " << lines[i] << std::endl;
+			g.Abandon();
+			return error;
+		}
+	}
+
+	std::cout << "Replayed " << applied << " commands into " << output << std::endl;
+	if (!last.empty())
+		std::cout << "Last: " << last << std::endl;
+	return ErrNone;
+}
@@ -0,0 +1,160 @@
+#include "rng.h"
+#include "db.h"
+
+#include <boost/nondet_random.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <cstdio>
+
+static inline uint32_t rotl(uint32_t v, int c)
+{
+	return (v << c) | (v >> (32-c));
+}
+
+#define QUARTER(a, b, c, d) \
+	a += b; d ^= a; d = rotl(d, 16); \
+	c += d; b ^= c; b = rotl(b, 12); \
+	a += b; d ^= a; d = rotl(d, 8); \
+	c += d; b ^= c; b = rotl(b, 7)
+
+static uint64_t splitMix(uint64_t &state)
+{
+	uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+Rng::Rng(Seed seed, uint64_t stream):_seed(seed),_stream(stream),_counter(0),_used(BlockWords*Blocks)
+{
+	uint64_t state = seed;
+	for(int i = 0; i < 8; i += 2)
+	{
+		const uint64_t v = splitMix(state);
+		_key[i] = uint32_t(v);
+		_key[i+1] = uint32_t(v >> 32);
+	}
+}
+
+void Rng::Refill()
+{
+	for(int block = 0; block < Blocks; ++block, ++_counter)
+	{
+		const uint32_t input[BlockWords] = {
+			0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+			_key[0], _key[1], _key[2], _key[3],
+			_key[4], _key[5], _key[6], _key[7],
+			uint32_t(_counter), uint32_t(_counter >> 32),
+			uint32_t(_stream), uint32_t(_stream >> 32)};
+		uint32_t x[BlockWords];
+		std::copy(input, input+BlockWords, x);
+
+		for(int round = 0; round < 10; ++round)
+		{
+			QUARTER(x[0], x[4], x[8],  x[12]);
+			QUARTER(x[1], x[5], x[9],  x[13]);
+			QUARTER(x[2], x[6], x[10], x[14]);
+			QUARTER(x[3], x[7], x[11], x[15]);
+			QUARTER(x[0], x[5], x[10], x[15]);
+			QUARTER(x[1], x[6], x[11], x[12]);
+			QUARTER(x[2], x[7], x[8],  x[13]);
+			QUARTER(x[3], x[4], x[9],  x[14]);
+		}
+
+		uint32_t *out = _buffer + block*BlockWords;
+		for(int i = 0; i < BlockWords; ++i)
+			out[i] = x[i] + input[i];
+	}
+	_used = 0;
+}
+
+uint32_t Rng::Next()
+{
+	if (_used == BlockWords*Blocks)
+		Refill();
+	return _buffer[_used++];
+}
+
+// Lemire's multiply and shift, rejecting the few values that would bias it
+uint32_t Rng::Below(uint32_t n)
+{
+	if (n <= 1)
+		return 0;
+	uint64_t m = uint64_t(Next()) * n;
+	uint32_t low = uint32_t(m);
+	if (low < n)
+	{
+		const uint32_t threshold = uint32_t(-n) % n;
+		while(low < threshold)
+		{
+			m = uint64_t(Next()) * n;
+			low = uint32_t(m);
+		}
+	}
+	return uint32_t(m >> 32);
+}
+
+Rng::Seed Rng::NextSeed()
+{
+	const Seed high = Next();
+	return (high << 32) | Next();
+}
+
+Rng::Seed DeviceSeed()
+{
+	boost::random_device dev;
+	return (Rng::Seed(dev()) << 32) | dev();
+}
+
+std::string SeedToString(Rng::Seed seed)
+{
+	char buffer[17];
+	std::snprintf(buffer, sizeof(buffer), "%016llx", (unsigned long long)seed);
+	return buffer;
+}
+
+bool SeedFromString(const std::string &text, Rng::Seed &seed)
+{
+	unsigned long long value;
+	char extra;
+	if (std::sscanf(text.c_str(), "%llx%c", &value, &extra) != 1)
+		return false;
+	seed = value;
+	return true;
+}
+
+static boost::scoped_ptr<Rng> s_session;
+
+Rng &SessionRng()
+{
+	if (!s_session)
+		s_session.reset(new Rng(DeviceSeed()));
+	return *s_session;
+}
+
+void SeedSession(Rng::Seed seed)
+{
+	s_session.reset(new Rng(seed));
+}
+
+static __thread Rng *t_current = NULL;
+
+Rng &CurrentRng()
+{
+	return t_current?*t_current:SessionRng();
+}
+
+ScopedRng::ScopedRng(Rng &rng):_previous(t_current)
+{
+	t_current = &rng;
+}
+
+ScopedRng::~ScopedRng()
+{
+	t_current = _previous;
+}
+
+int CivRand(int n)
+{
+	return int(CurrentRng().Below(n));
+}
@@ -0,0 +1,65 @@
+#ifndef RNG_H__
+#define RNG_H__
+
+#include <stdint.h>
+#include <string>
+
+// ChaCha20 keystream used as a random number generator.  A 64 bit seed is
+// expanded into the key, and each stream number gives an independent
+// sequence from the same seed.  Output is produced several blocks at a time.
+class Rng
+{
+	public:
+		typedef uint64_t Seed;
+
+		explicit Rng(Seed seed, uint64_t stream = 0);
+
+		uint32_t Next();
+		// Uniform in [0, n) without the bias of Next()%n
+		uint32_t Below(uint32_t n);
+		// Lets an Rng be handed to std::random_shuffle
+		int operator()(int n) {return Below(n);}
+		// Seed for a child generator, a new one on every call
+		Seed NextSeed();
+
+		Seed GetSeed() const {return _seed;}
+		uint64_t GetStream() const {return _stream;}
+
+	private:
+		static const int BlockWords = 16;
+		static const int Blocks = 4;
+
+		void Refill();
+
+		Seed _seed;
+		uint64_t _stream;
+		uint32_t _key[8];
+		uint64_t _counter;
+		uint32_t _buffer[BlockWords*Blocks];
+		int _used;
+};
+
+Rng::Seed DeviceSeed();
+std::string SeedToString(Rng::Seed seed);
+bool SeedFromString(const std::string &text, Rng::Seed &seed);
+
+// The session generator is seeded from the random device on first use unless
+// SeedSession was called first
+Rng &SessionRng();
+void SeedSession(Rng::Seed seed);
+
+// Generator used by CivRand on this thread, the session one unless a
+// ScopedRng is active
+Rng &CurrentRng();
+
+class ScopedRng
+{
+	public:
+		explicit ScopedRng(Rng &rng);
+		~ScopedRng();
+
+	private:
+		Rng *_previous;
+};
+
+#endif
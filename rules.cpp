@@ -0,0 +1,21 @@
+#include "rules.h"
+
+#include <boost/foreach.hpp>
+
+static_assert(CivProject30Rules::CivPoints(99) == 1 && CivProject30Rules::CivPoints(200) == 3 &&
+	CivProject30Rules::CivPoints(201) == 6, "CivProject30 point steps");
+
+static const RulesetOf<AdvCivRules> s_advCiv;
+static const RulesetOf<CivProject21Rules> s_civProject21;
+static const RulesetOf<CivProject30Rules> s_civProject30;
+
+const Ruleset *FindRuleset(const std::string &name)
+{
+	static const Ruleset *rulesets[] = {&s_advCiv, &s_civProject21, &s_civProject30};
+	BOOST_FOREACH(auto rules, rulesets)
+	{
+		if (name == rules->Name())
+			return rules;
+	}
+	return NULL;
+}
@@ -0,0 +1,90 @@
+#ifndef RULES_H__
+#define RULES_H__
+
+#include "db.h"
+
+#include <climits>
+
+// Civ card points for costs below _below, steps are in increasing order
+struct PointStep
+{
+	int _below;
+	int _points;
+};
+
+constexpr int StepPoints(const PointStep *steps, int cost)
+{
+	return cost < steps->_below?steps->_points:StepPoints(steps+1, cost);
+}
+
+constexpr PointStep CivProject30Steps[] = {{100, 1}, {201, 3}, {INT_MAX, 6}};
+
+// Each ruleset is a policy type whose tables are constants, so the loops that
+// use them are compiled once per ruleset with nothing left to look up.
+//
+//  Name         value of the "ruleset" variable
+//  Supplements  card lists have a supplement column after the count
+//  Decks        decks in the game, deck 0 is never dealt
+//  Scoring      which of the scoreboard's civ point totals counts
+//  CivPoints    points for a civ card of the given cost
+//  CreateDeck   deals one deck, false when the ruleset can't be dealt
+struct AdvCivRules
+{
+	static constexpr const char *Name = "AdvCiv";
+	static constexpr bool Supplements = false;
+	static constexpr int Decks = 10;
+	static constexpr Scoreboard::Scoring Scoring = Scoreboard::AdvCivScoring;
+	static constexpr int CivPoints(int cost) {return cost;}
+	static bool CreateDeck(Game &g, int deck);
+};
+
+struct CivProject21Rules
+{
+	static constexpr const char *Name = "CivProject21";
+	static constexpr bool Supplements = false;
+	static constexpr int Decks = 10;
+	static constexpr Scoreboard::Scoring Scoring = Scoreboard::CivProject21Scoring;
+	static constexpr int CivPoints(int cost) {return cost/100+1;}
+	static bool CreateDeck(Game &, int) {return false;}
+};
+
+struct CivProject30Rules
+{
+	static constexpr const char *Name = "CivProject30";
+	static constexpr bool Supplements = true;
+	static constexpr int Decks = 10;
+	static constexpr Scoreboard::Scoring Scoring = Scoreboard::CivProject30Scoring;
+	static constexpr int CivPoints(int cost) {return StepPoints(CivProject30Steps, cost);}
+	static bool CreateDeck(Game &g, int deck);
+};
+
+// A ruleset policy behind the one pointer the game keeps, see Game::Rules
+class Ruleset
+{
+	public:
+		virtual ~Ruleset(){}
+		virtual const char *Name() const = 0;
+		virtual bool Supplements() const = 0;
+		virtual Scoreboard::Scoring Scoring() const = 0;
+		virtual int CivPoints(int cost) const = 0;
+		virtual bool CreateDecks(Game &g) const = 0;
+};
+
+// Deals decks 1 to decks-1 with createDeck, see dbUtils.cpp
+bool CreateDecks(Game &g, int decks, bool (*createDeck)(Game &, int));
+
+template<class Rules>
+class RulesetOf : public Ruleset
+{
+	public:
+		const char *Name() const {return Rules::Name;}
+		bool Supplements() const {return Rules::Supplements;}
+		Scoreboard::Scoring Scoring() const {return Rules::Scoring;}
+		int CivPoints(int cost) const {return Rules::CivPoints(cost);}
+		bool CreateDecks(Game &g) const {return ::CreateDecks(g, Rules::Decks, Rules::CreateDeck);}
+};
+
+// NULL when no ruleset has that name
+const Ruleset *FindRuleset(const std::string &name);
+
+#endif
@@ -0,0 +1,128 @@
+#include "scores.h"
+#include "dbUtils.h"
+#include "rules.h"
+
+#include <boost/foreach.hpp>
+
+#include <algorithm>
+
+namespace
+{
+	// Both kernels are plain loops over contiguous ints with no aliasing, which
+	// the compiler turns into vector instructions
+	int squaresDot(const int *__restrict counts, const int *__restrict weights, int n)
+	{
+		int sum = 0;
+		for(int i = 0; i < n; ++i)
+			sum += counts[i]*counts[i]*weights[i];
+		return sum;
+	}
+
+	int dot(const int *__restrict owned, const int *__restrict points, int n)
+	{
+		int sum = 0;
+		for(int i = 0; i < n; ++i)
+			sum += owned[i]*points[i];
+		return sum;
+	}
+}
+
+ScoreTable::ScoreTable(const Game &g, Source source):_powers(g._powerIds.size()),_cards(g._cardIds.size()),_civcards(g._civcards.size())
+{
+	_weights.resize(_cards);
+	for(int id = 0; id < _cards; ++id)
+	{
+		const CardP &card = g._cardIds[id];
+		if (card && card->_type == Card::Normal)
+			_weights[id] = card->_deck;
+	}
+
+	// Looked up by address, comparing civ cards compares names
+	std::vector<std::pair<const CivCard *, int> > columns;
+	BOOST_FOREACH(auto card, g._civcards)
+	{
+		columns.push_back(std::make_pair(card.get(), int(_costs.size())));
+		_costs.push_back(card->_cost);
+	}
+	std::sort(columns.begin(), columns.end());
+
+	_counts.resize(_powers*_cards);
+	_owned.resize(_powers*_civcards);
+	for(int p = 0; p < _powers; ++p)
+	{
+		const Power &power = *g._powerIds[p];
+		if (source == FromHands)
+		{
+			BOOST_FOREACH(auto card, power._hand)
+				++_counts[p*_cards + card->_id];
+		}
+		else if (_cards)
+			power.Counts().CopyTo(&_counts[p*_cards], _cards);
+		BOOST_FOREACH(auto card, power._civCards._cards)
+		{
+			auto column = std::lower_bound(columns.begin(), columns.end(), std::make_pair((const CivCard *)card.get(), 0));
+			if (column != columns.end() && column->first == card.get())
+				_owned[p*_civcards + column->second] = 1;
+		}
+	}
+}
+
+void ScoreTable::HandValues(std::vector<int> &values) const
+{
+	values.assign(_powers, 0);
+	if (!_cards)
+		return;
+	for(int p = 0; p < _powers; ++p)
+		values[p] = squaresDot(&_counts[p*_cards], &_weights[0], _cards);
+}
+
+void ScoreTable::CivPoints(const Ruleset &rules, std::vector<int> &points) const
+{
+	points.assign(_powers, 0);
+	if (!_civcards)
+		return;
+	std::vector<int> column(_civcards);
+	for(int i = 0; i < _civcards; ++i)
+		column[i] = rules.CivPoints(_costs[i]);
+	for(int p = 0; p < _powers; ++p)
+		points[p] = dot(&_owned[p*_civcards], &column[0], _civcards);
+}
+
+void FindScoreProblems(const Game &g, std::vector<Discrepancy> &problems)
+{
+	// Counts are kept alongside the scoreboard, so the hands are what it is
+	// checked against
+	const ScoreTable table(g, ScoreTable::FromHands);
+	std::vector<int> values, points;
+	table.HandValues(values);
+	if (g.Rules())
+		table.CivPoints(*g.Rules(), points);
+
+	for(int p = 0; p < table.Powers(); ++p)
+	{
+		const Power &power = *g._powerIds[p];
+		const Scoreboard &score = power.Score();
+		if (score._handValue != values[p])
+		{
+			const Discrepancy d = {power._name, "hand value", score._handValue, values[p]};
+			problems.push_back(d);
+		}
+		if (g.Rules() && score._civPoints[g.Rules()->Scoring()] != points[p])
+		{
+			const Discrepancy d = {power._name, "civ points", score._civPoints[g.Rules()->Scoring()], points[p]};
+			problems.push_back(d);
+		}
+	}
+}
+
+int CheckScores(const Game &g, std::ostream &out)
+{
+	std::vector<Discrepancy> problems;
+	FindScoreProblems(g, problems);
+	BOOST_FOREACH(auto &d, problems)
+	{
+		out << d._name << ": " << d._kind << " kept as " << d._kept << ", "
+			<< (d._kind == "hand value"?"hand":"portfolio") << " is worth " << d._actual << std::endl;
+	}
+	return problems.size();
+}
@@ -0,0 +1,47 @@
+#ifndef SCORES_H__
+#define SCORES_H__
+
+#include "db.h"
+
+#include <ostream>
+#include <vector>
+
+class Ruleset;
+struct Discrepancy;
+
+// Every power's hand as copies by card id and portfolio as owned civ cards,
+// one row per power id, so scoring all the powers is a pass over flat arrays
+// instead of a walk of each hand's tree
+class ScoreTable
+{
+	public:
+		enum Source
+		{
+			FromCounts, // Each power's CardCounts, kept with its hand
+			FromHands, // Each power's _hand walked, independent of any cache
+		};
+
+		explicit ScoreTable(const Game &g, Source source = FromCounts);
+		int Powers() const {return _powers;}
+		// Same as ValueHand of each hand, by power id
+		void HandValues(std::vector<int> &values) const;
+		// Civ card points of each portfolio under rules, by power id
+		void CivPoints(const Ruleset &rules, std::vector<int> &points) const;
+
+	private:
+		int _powers;
+		int _cards; // Row length of _counts, card ids
+		int _civcards; // Row length of _owned
+		std::vector<int> _counts;
+		std::vector<int> _weights; // Deck of each commodity card, 0 for calamities
+		std::vector<int> _owned; // 1 when the power holds the civ card
+		std::vector<int> _costs;
+};
+
+// Powers whose running totals (see Scoreboard) disagree with their hand and
+// portfolio
+void FindScoreProblems(const Game &g, std::vector<Discrepancy> &problems);
+// FindScoreProblems written to out.  Returns how many.
+int CheckScores(const Game &g, std::ostream &out);
+
+#endif
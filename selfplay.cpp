@@ -0,0 +1,356 @@
+#include "dbUtils.h"
+#include "parser.h"
+#include "plan.h"
+#include "pool.h"
+#include "rng.h"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <algorithm>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Scripted player.  Every turn it draws, trades three cards, buys civ cards
+// and discards down to a hand limit, each step through the shell's commands.
+struct Bot
+{
+	std::string _name;
+	int _draw; // Cards drawn, one per deck
+	std::string _trade; // none, dump (least valuable cards) or calamity (tradable calamities first)
+	std::string _buy; // none, cheapest (one at a time) or plan
+	int _keep; // Commodity cards kept after buying, 0 keeps them all
+
+	Bot():_draw(9),_trade("dump"),_buy("plan"),_keep(8){}
+};
+
+// draw=9,trade=dump,buy=plan,keep=8 with any of them left out
+bool parseBot(const std::string &spec, Bot &bot)
+{
+	bot._name = spec;
+	std::vector<std::string> settings;
+	boost::split(settings, spec, boost::is_any_of(","));
+	BOOST_FOREACH(auto &setting, settings)
+	{
+		std::vector<std::string> pair;
+		boost::split(pair, setting, boost::is_any_of("="));
+		if (pair.size() != 2)
+			return false;
+		if (pair[0] == "draw")
+			bot._draw = boost::lexical_cast<int>(pair[1]);
+		else if (pair[0] == "trade" && (pair[1] == "none" || pair[1] == "dump" || pair[1] == "calamity"))
+			bot._trade = pair[1];
+		else if (pair[0] == "buy" && (pair[1] == "none" || pair[1] == "cheapest" || pair[1] == "plan"))
+			bot._buy = pair[1];
+		else if (pair[0] == "keep")
+			bot._keep = boost::lexical_cast<int>(pair[1]);
+		else
+			return false;
+	}
+	return true;
+}
+
+struct Setup
+{
+	std::string _cards;
+	std::string _powers;
+	std::string _ruleset;
+	CivCards _civcards; // Read once, the cards never change so games share them
+	int _turns;
+	Rng::Seed _seed;
+	std::vector<Bot> _bots; // Dealt to the powers in turn order
+};
+
+struct Result
+{
+	bool _created;
+	std::vector<int> _scores; // By seat
+	int _commands;
+	int _errors;
+};
+
+double seconds()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+std::string escape(const std::string &name)
+{
+	return boost::replace_all_copy(name, " ", "\\ ");
+}
+
+// Commodity cards least worth keeping first: the smallest sets, then the
+// cheapest decks.  Tradable calamities go first when they are wanted gone.
+void rankCards(const Hand &hand, bool calamities, std::vector<CardP> &ranked)
+{
+	BOOST_FOREACH(auto card, hand)
+	{
+		if (card->_type == Card::Normal || (calamities && card->_type == Card::Tradable))
+			ranked.push_back(card);
+	}
+	std::stable_sort(ranked.begin(), ranked.end(), [&hand](const CardP &l, const CardP &r)
+	{
+		if ((l->_type == Card::Tradable) != (r->_type == Card::Tradable))
+			return l->_type == Card::Tradable;
+		const int lcount = hand.count(l), rcount = hand.count(r);
+		if (lcount != rcount)
+			return lcount < rcount;
+		return l->_deck < r->_deck;
+	});
+}
+
+class SelfPlay
+{
+	public:
+		SelfPlay(const Setup &setup, Game &g, Result &result):_setup(setup),_g(g),_result(result),_null(NULL){}
+
+		void Turn(int turn);
+
+	private:
+		int Run(const std::string &line);
+		void Trade(int turn);
+		void Buy(const Bot &bot, Power &power);
+		void Discard(const Bot &bot, Power &power);
+		const Bot &BotOf(int seat) const {return _setup._bots[seat%_setup._bots.size()];}
+
+		const Setup &_setup;
+		Game &_g;
+		Result &_result;
+		std::ostream _null;
+};
+
+int SelfPlay::Run(const std::string &line)
+{
+	++_result._commands;
+	const int error = ParseLine(line, _g, _null);
+	if (error != ErrNone && error != ErrInsufficientFunds)
+		++_result._errors;
+	return error;
+}
+
+void SelfPlay::Turn(int turn)
+{
+	std::string draw = "turn 0";
+	for(int seat = 0; seat < _g._powerIds.size(); ++seat)
+		draw += " " + escape(_g._powerIds[seat]->_name) + " " + boost::lexical_cast<std::string>(BotOf(seat)._draw);
+	Run(draw);
+
+	Trade(turn);
+
+	for(int seat = 0; seat < _g._powerIds.size(); ++seat)
+	{
+		Buy(BotOf(seat), *_g._powerIds[seat]);
+		Discard(BotOf(seat), *_g._powerIds[seat]);
+	}
+}
+
+// Each power trades with the one a turn-dependent distance after it, when
+// both of them trade and neither has traded yet this turn
+void SelfPlay::Trade(int turn)
+{
+	const int seats = _g._powerIds.size();
+	if (seats < 2)
+		return;
+	std::vector<bool> traded(seats);
+	for(int seat = 0; seat < seats; ++seat)
+	{
+		const int partner = (seat+1+turn%(seats-1))%seats;
+		if (traded[seat] || traded[partner] || BotOf(seat)._trade == "none" || BotOf(partner)._trade == "none")
+			continue;
+
+		std::string line = "trade";
+		const int sides[] = {seat, partner};
+		int filled = 0;
+		BOOST_FOREACH(auto side, sides)
+		{
+			const Power &power = *_g._powerIds[side];
+			std::vector<CardP> ranked;
+			rankCards(power._hand, BotOf(side)._trade == "calamity", ranked);
+			if (ranked.size() < 3)
+				break;
+			line += " " + escape(power._name);
+			for(int i = 0; i < 3; ++i)
+				line += " " + escape(ranked[i]->_name);
+			++filled;
+		}
+		if (filled != 2)
+			continue;
+		if (Run(line) == ErrNone)
+			traded[seat] = traded[partner] = true;
+	}
+}
+
+void SelfPlay::Buy(const Bot &bot, Power &power)
+{
+	std::vector<CivCardP> wanted;
+	if (bot._buy == "plan")
+	{
+		std::vector<Purchase> plans;
+		bool complete;
+		if (PlanPurchases(_g, power, 0, 1, plans, complete) && !plans.empty())
+			wanted = plans[0]._cards;
+	}
+	else if (bot._buy == "cheapest")
+	{
+		BOOST_FOREACH(auto card, _g._civcards)
+		{
+			if (!power.Has(card))
+				wanted.push_back(card);
+		}
+		std::stable_sort(wanted.begin(), wanted.end(), [&power](const CivCardP &l, const CivCardP &r)
+		{
+			return power._civCards.Cost(l) < power._civCards.Cost(r);
+		});
+	}
+
+	BOOST_FOREACH(auto card, wanted)
+	{
+		if (Run("buy " + escape(power._name) + " auto " + escape(card->_name)) != ErrNone)
+			break;
+	}
+}
+
+void SelfPlay::Discard(const Bot &bot, Power &power)
+{
+	std::vector<CardP> ranked;
+	rankCards(power._hand, false, ranked);
+	if (!bot._keep || ranked.size() <= bot._keep)
+		return;
+	std::string line = "discard " + escape(power._name);
+	for(int i = 0; i < ranked.size()-bot._keep; ++i)
+		line += " " + escape(ranked[i]->_name);
+	Run(line);
+}
+
+void playGame(const Setup &setup, std::vector<Result> &results, int game)
+{
+	Rng rng(setup._seed, game);
+	ScopedRng scoped(rng);
+	Result &result = results[game];
+	result._commands = result._errors = 0;
+
+	Game g("", true);
+	result._created = CreateGame(setup._cards, setup._powers, setup._ruleset, g);
+	if (!result._created)
+		return;
+	BOOST_FOREACH(auto card, setup._civcards)
+		g.AddCivCard(card);
+
+	SelfPlay play(setup, g, result);
+	for(int turn = 0; turn < setup._turns; ++turn)
+		play.Turn(turn);
+
+	BOOST_FOREACH(auto power, g._powerIds)
+	{
+		int score = 0;
+		BOOST_FOREACH(auto &points, CountPoints(g, *power))
+			score += points.second;
+		result._scores.push_back(score);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 5)
+	{
+		std::cerr << argv[0] << " CardList PowerList RuleSet CivCards [#Games] [#Turns] [#Threads] [Seed] [Bot] ..." << std::endl;
+		std::cerr << "\tBot: draw=9,trade=none/dump/calamity,buy=none/cheapest/plan,keep=8" << std::endl;
+		return ErrUnableToParse;
+	}
+
+	Setup setup;
+	setup._cards = argv[1];
+	setup._powers = argv[2];
+	setup._ruleset = argv[3];
+	{
+		// ParseCivCards lists every card it reads on std::cout
+		Game civ("", true);
+		std::streambuf *console = std::cout.rdbuf(NULL);
+		const bool parsed = ParseCivCards(argv[4], civ);
+		std::cout.rdbuf(console);
+		std::cout.clear();
+		if (!parsed)
+		{
+			std::cerr << "Can't read " << argv[4] << std::endl;
+			return ErrUnableToParse;
+		}
+		setup._civcards = civ._civcards;
+	}
+	const int games = argc > 5?boost::lexical_cast<int>(argv[5]):100;
+	setup._turns = argc > 6?boost::lexical_cast<int>(argv[6]):20;
+	const int threads = argc > 7?boost::lexical_cast<int>(argv[7]):std::max<int>(boost::thread::hardware_concurrency(), 1);
+	setup._seed = DeviceSeed();
+	if (argc > 8 && !SeedFromString(argv[8], setup._seed))
+		return ErrUnableToParse;
+	for(int i = 9; i < argc; ++i)
+	{
+		Bot bot;
+		if (!parseBot(argv[i], bot))
+		{
+			std::cerr << "Bad bot " << argv[i] << std::endl;
+			return ErrUnableToParse;
+		}
+		setup._bots.push_back(bot);
+	}
+	if (setup._bots.empty())
+	{
+		setup._bots.push_back(Bot());
+		setup._bots.back()._name = "default";
+	}
+
+	// Games take uneven time, the pool hands them out one at a time to
+	// whichever thread is free
+	std::vector<Result> results(games);
+	ThreadPool pool(threads);
+	const double start = seconds();
+	pool.ParallelFor(games, boost::bind(playGame, boost::cref(setup), boost::ref(results), _1));
+	const double elapsed = seconds()-start;
+
+	// Per bot: seats played, total, lowest and highest score, games won
+	const int bots = setup._bots.size();
+	std::vector<int> seats(bots), wins(bots), low(bots, 1<<30), high(bots, -1);
+	std::vector<double> total(bots);
+	int played = 0, commands = 0, errors = 0;
+	BOOST_FOREACH(auto &result, results)
+	{
+		if (!result._created)
+			continue;
+		++played;
+		commands += result._commands;
+		errors += result._errors;
+		const int best = result._scores.empty()?0:*std::max_element(result._scores.begin(), result._scores.end());
+		for(int seat = 0; seat < result._scores.size(); ++seat)
+		{
+			const int bot = seat%bots;
+			const int score = result._scores[seat];
+			++seats[bot];
+			total[bot] += score;
+			low[bot] = std::min(low[bot], score);
+			high[bot] = std::max(high[bot], score);
+			if (score == best)
+				++wins[bot];
+		}
+	}
+	if (played < games)
+		std::cerr << games-played << " games could not be created" << std::endl;
+
+	std::cout << "Seed " << SeedToString(setup._seed) << ", " << played << " games of " << setup._turns
+		<< " turns on " << pool.Threads() << " threads" << std::endl;
+	std::cout << elapsed << "s\t" << played/elapsed << " games/s\t" << commands/elapsed << " commands/s\t"
+		<< errors << " failed commands" << std::endl;
+	std::cout << "Bot\tSeats\tMean\tLow\tHigh\tWins" << std::endl;
+	for(int bot = 0; bot < bots; ++bot)
+	{
+		if (!seats[bot])
+			continue;
+		std::cout << setup._bots[bot]._name << '\t' << seats[bot] << '\t' << total[bot]/seats[bot]
+			<< '\t' << low[bot] << '\t' << high[bot] << '\t' << wins[bot] << std::endl;
+	}
+	return errors?ErrUnableToParse:ErrNone;
+}
@@ -2,6 +2,8 @@
 #include "dbUtils.h"
 #include "parser.h"
 #include "factory.h"
+#include "stats.h"
+#include "journal.h"
 
 #include <boost/algorithm/string.hpp>
 #include <boost/serialization/singleton.hpp> // has nothing to do with s11n
@@ -23,18 +25,101 @@ namespace fs = boost::filesystem;
 #include <readline/history.h>
 
 #include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
 #include <iostream>
 
-const std::string version("0.36");
+const std::string version("0.37");
 //typedef std::map<std::string, std::string> HelpText;
 
-boost::scoped_ptr<Game> s_g;
+boost::shared_ptr<Game> s_g;
+boost::shared_ptr<Game> s_fork; // Commands and completion use it instead while it's set
 
-typedef boost::function<char *(const char *, int)> FillFunc;
+Game &activeGame()
+{
+	return s_fork?*s_fork:*s_g;
+}
+
+typedef std::vector<std::string> Matches;
+
+// Sorted (lower case name, escaped name) pairs for prefix lookups
+typedef std::vector<std::pair<std::string, std::string>> SortedNames;
+
+// Per power completion candidates.  They are rebuilt on a worker thread after
+// every command that changes the game so that tab completion only ever reads
+// a finished snapshot and never scans the game itself.
+class CandidateCache
+{
+	public:
+		struct PowerCandidates
+		{
+			SortedNames _hand;
+			SortedNames _civNot;
+		};
+		typedef std::map<std::string, PowerCandidates> Snapshot;
+		typedef boost::shared_ptr<const Snapshot> SnapshotP;
+
+		explicit CandidateCache(boost::mutex &gameLock):_gameLock(gameLock){}
+
+		void Refresh(const Game &g)
+		{
+			Wait();
+			_worker = boost::thread(boost::bind(&CandidateCache::Rebuild, this, boost::cref(g)));
+		}
+
+		void Wait()
+		{
+			if (_worker.joinable())
+				_worker.join();
+		}
+
+		SnapshotP Get()
+		{
+			boost::mutex::scoped_lock lock(_lock);
+			return _current;
+		}
+
+	private:
+		static void Add(SortedNames &names, const std::string &name)
+		{
+			names.push_back(std::make_pair(boost::to_lower_copy(name), boost::replace_all_copy(name, " ", "\\ ")));
+		}
+
+		void Rebuild(const Game &g)
+		{
+			boost::shared_ptr<Snapshot> snapshot(new Snapshot);
+			{
+				boost::mutex::scoped_lock lock(_gameLock);
+				BOOST_FOREACH(auto power, g._powers)
+				{
+					PowerCandidates &c = (*snapshot)[boost::to_lower_copy(power.first->_name)];
+					const Hand &hand = power.first->_hand;
+					for(auto i = hand.begin(); i != hand.end(); i = hand.upper_bound(*i))
+						Add(c._hand, (*i)->_name);
+					BOOST_FOREACH(auto card, g._civcards)
+					{
+						if (!power.first->Has(card))
+							Add(c._civNot, card->_name);
+					}
+				}
+			}
+			BOOST_FOREACH(auto &i, *snapshot)
+			{
+				std::sort(i.second._hand.begin(), i.second._hand.end());
+				std::sort(i.second._civNot.begin(), i.second._civNot.end());
+			}
+
+			boost::mutex::scoped_lock lock(_lock);
+			_current = snapshot;
+		}
 
-std::vector<FillFunc> g_fillFuncs;
-std::string g_currentPower;
-int g_currentDeck(0);
+		boost::mutex &_gameLock;
+		boost::mutex _lock;
+		SnapshotP _current;
+		boost::thread _worker;
+};
+
+boost::mutex s_gameLock;
+CandidateCache s_candidates(s_gameLock);
 
 typedef boost::function<char **(const std::vector<std::string> &, const char *, int)> CompleteFunc;
 typedef FactoryOwner<CompleteFunc> Completer;
@@ -46,336 +131,270 @@ typedef boost::serialization::singleton<Completer> CompleteFactory;
 
 const char *objectList[] = {"powers","players","decks","discards","calamities","evil","points"};
 const char *rulesList[] = {"AdvCiv","CivProject21","CivProject30"};
+const char *formatList[] = {"text","tsv","json"};
+const char *importList[] = {"Civ"};
+const char *typeList[] = {"0","-1","-2","-3"};
+const char *numberList[] = {"1","2","3","4","5","6","7","8","9"};
+const char *fiveList[] = {"0","5","10","15","20","25","30","35","40","45"};
 
-char *fillBuffer(const std::string &name, const std::string &text, int &state)
-{
-	const std::string escapedName = boost::replace_all_copy(name, " ", "\\ ");
-	const int len = escapedName.size()+1;
-	
-	if (boost::istarts_with(name, text))
-	{
-		if (state <= 0)
-		{
-			char *c = (char *)std::malloc(len);
-			std::strncpy(c, escapedName.c_str(),len);
-			return c;		
-		}
-		else
-		{
-			state--;
-		}
-	}
-	return NULL;
-}
+#define LIST_SIZE(_list) (sizeof(_list)/sizeof(const char *))
 
-char *fillFromArray(const std::string &text, int state, const char **list, const int numValues)
+// Builds the array readline expects: the common prefix to substitute for the
+// text, followed by every match, terminated by NULL
+char **completionList(const char *text, Matches &matches)
 {
-	int skip = state;
+	std::sort(matches.begin(), matches.end());
+	matches.erase(std::unique(matches.begin(), matches.end()), matches.end());
+	if (matches.empty())
+		return NULL;
 
-	for(int i = 0; i < numValues; ++i)
+	std::string common = matches.front();
+	BOOST_FOREACH(auto &i, matches)
 	{
-		char *value = NULL;
-		if (value = fillBuffer(list[i], text, skip))
-		{
-			return value;
-		}
+		int len = 0;
+		while(len < common.size() && len < i.size() && common[len] == i[len])
+			++len;
+		common.resize(len);
 	}
-	return NULL;
+	if (common.size() < std::strlen(text))
+		common = text;
+
+	const int offset = matches.size() == 1?0:1;
+	char **list = (char **)std::malloc((matches.size()+offset+1)*sizeof(char *));
+	if (offset)
+		list[0] = strdup(common.c_str());
+	for(int i = 0; i < matches.size(); ++i)
+		list[i+offset] = strdup(matches[i].c_str());
+	list[matches.size()+offset] = NULL;
+	return list;
 }
 
-char *fillFromComplete(const char *text, int state)
+void arrayMatches(const char *text, const char **list, const int numValues, Matches &matches)
 {
-	int skip = state;
-
-	const Completer &c = CompleteFactory::get_const_instance();
-	
-	BOOST_FOREACH(auto i, c)
+	for(int i = 0; i < numValues; ++i)
 	{
-		char *value = NULL;
-		if (value = fillBuffer(i.first, text, skip))
-			return value;
+		if (boost::istarts_with(list[i], text))
+			matches.push_back(boost::replace_all_copy(std::string(list[i]), " ", "\\ "));
 	}
-
-	return NULL;
 }
 
-char *aggregateFill(const char *text, int state)
+template<typename T> void trieMatches(const PrefixTrie<T> &trie, const char *text, Matches &matches)
 {
-	static int oldVisits = 0;
-	static int visits = -1;
-	static int prevFunc = -1;
-
-	++visits;
-
-	for(int i = 0; i < g_fillFuncs.size(); ++i)
+	trie.Visit(text, [&matches](const typename PrefixTrie<T>::Entry &e)
 	{
-		char *value = NULL;
-		if (i <= prevFunc)
-			continue;
-		if (value = g_fillFuncs[i](text, state-oldVisits))
-		{
-			return value;
-		}
-
-		prevFunc = i;
-		oldVisits = visits;
-	}
-	
-	oldVisits = 0;
-	visits = -1;
-	prevFunc = -1;
-	return NULL;
+		matches.push_back(e.first);
+	});
 }
 
-char *groupFill(const char *text, int state)
+void sortedMatches(const SortedNames &names, const char *text, Matches &matches)
 {
-	const int matchLen = std::strlen(text);
-
-	BOOST_FOREACH(auto i, CivCard::_groupList)
+	const std::string prefix = boost::to_lower_copy(std::string(text));
+	for(auto i = std::lower_bound(names.begin(), names.end(), std::make_pair(prefix, std::string()));
+		i != names.end() && boost::starts_with(i->first, prefix); ++i)
 	{
-		char *value = NULL;
-                if (value = fillBuffer(i, text, state))
-			return value;
+		matches.push_back(i->second);
 	}
-	return NULL;
 }
 
-char *countryFill(const char *text, int state)
+void commandMatches(const char *text, Matches &matches)
 {
-	const int matchLen = std::strlen(text);
+	const Completer &c = CompleteFactory::get_const_instance();
 	
-	BOOST_FOREACH(auto i, s_g->_powers)
+	BOOST_FOREACH(auto i, c)
 	{
-		char *value = NULL;
-		if (value = fillBuffer(i.first->_name, text, state))
-			return value;
+		if (boost::istarts_with(i.first, text))
+			matches.push_back(i.first);
 	}
-	return NULL;
 }
 
-char *setFill(const char *text, int state)
+void powerMatches(const char *text, Matches &matches)
 {
-	BOOST_FOREACH(auto i, s_g->_vars)
-	{
-		char *value = NULL;
-		if (value = fillBuffer(i.first, text, state))
-			return value;
-	}
-	return NULL;
+	trieMatches(activeGame()._names._powers, text, matches);
 }
 
-char *importFill(const char *text, int state)
+const CandidateCache::PowerCandidates *findCandidates(const CandidateCache::SnapshotP &snapshot, const std::string &power)
 {
-	const char *types[] = {"Civ"};
-	const int len = sizeof(types)/sizeof(const char *);
-	for(int i = 0; i < len; ++i)
-	{
-		char *value = NULL;
-		if (value = fillBuffer(types[i], text, state))
-			return value;
-	}
-	return NULL;
+	if (!snapshot)
+		return NULL;
+	auto i = snapshot->find(boost::to_lower_copy(power));
+	if (i == snapshot->end())
+		return NULL;
+	return &i->second;
 }
 
-char *typeFill(const char *text, int state)
+// Cards in the power's hand, or every card if the power isn't known
+void handMatches(const std::string &power, const char *text, Matches &matches)
 {
-	const char *numbers[] = {"0","-1","-2","-3"};
-	const int len = sizeof(numbers)/sizeof(const char *);
-	for(int i =0 ; i < len; ++i)
-	{
-		char *value = NULL;
-		if (value = fillBuffer(numbers[i], text, state))
-			return value;
-	}
-	return NULL;
+	const CandidateCache::SnapshotP snapshot = s_candidates.Get();
+	const CandidateCache::PowerCandidates *c = findCandidates(snapshot, power);
+	if (c)
+		sortedMatches(c->_hand, text, matches);
+	else
+		trieMatches(activeGame()._names._cards, text, matches);
 }
 
-int countMatches(const std::string &text, const std::string &match)
+void deckMatches(int deck, const char *text, Matches &matches)
 {
-	int matches = 0;
-	int pos = text.find(match);
-	while (pos != std::string::npos)
+	activeGame()._names._cards.Visit(text, [&](const PrefixTrie<CardP>::Entry &e)
 	{
-		++matches;
-		pos = text.find(match, pos+1);
-	}
-
-	return matches;
+		if (e.second->_deck == deck)
+			matches.push_back(e.first);
+	});
 }
 
-char *cardFill(const char *text, int state)
+// Civ cards the power doesn't own yet, or every civ card if the power isn't known
+void civNotMatches(const std::string &power, const char *text, Matches &matches)
 {
-	Powers::const_iterator power = s_g->FindPower(g_currentPower);
-	const std::string buffer(rl_line_buffer,rl_point);
-
-	if (power != s_g->_powers.end())
-	{
-		BOOST_FOREACH(auto i, power->first->_hand)
-		{
-			if (char *value = fillBuffer(i->_name, text, state))
-				return value;
-		}
-	} else
-	{
-		BOOST_FOREACH(auto i, s_g->_cards)
-		{
-			if (g_currentDeck && i->_deck != g_currentDeck)
-				continue;
-			char *value = NULL;
-			if (value = fillBuffer(i->_name, text, state))
-				return value;
-		}
-	}
-	return NULL;
+	const CandidateCache::SnapshotP snapshot = s_candidates.Get();
+	const CandidateCache::PowerCandidates *c = findCandidates(snapshot, power);
+	if (c)
+		sortedMatches(c->_civNot, text, matches);
+	else
+		trieMatches(activeGame()._names._civcards, text, matches);
 }
 
-char *civNotFill(const char *text, int state)
+void numberMatches(const char *text, Matches &matches)
 {
-	Powers::const_iterator power = s_g->FindPower(g_currentPower);
-	const std::string buffer(rl_line_buffer,rl_point);
+	arrayMatches(text, numberList, LIST_SIZE(numberList), matches);
+}
 
-	if (power != s_g->_powers.end())
-	{
-		CivCards cards;
-		CivCardCompare cc;
-		std::set_difference(s_g->_civcards.begin(), 
-				s_g->_civcards.end(),
-				power->first->_civCards._cards.begin(),
-				power->first->_civCards._cards.end(),
-				std::inserter(cards,cards.begin()),
-				boost::bind(&CivCardCompare::operator(), cc, _1, _2));
-		BOOST_FOREACH(auto i, cards)
-		{
-			if (char *value = fillBuffer(i->_name, text, state))
-				return value;
-		}
-	} else
+char **completeHelp(const std::vector<std::string> &, const char *text, int depth)
+{
+	Matches matches;
+	switch (depth)
 	{
-		BOOST_FOREACH(auto i, s_g->_civcards)
-		{
-			char *value = NULL;
-			if (value = fillBuffer(i->_name, text, state))
-				return value;
-		}
+		case 1:
+			commandMatches(text, matches);
+			break;
 	}
-	return NULL;
+	return completionList(text, matches);
 }
-/*
-char *civFill(const char *text, int state)
+
+char **completeFork(const std::vector<std::string> &, const char *text, int depth)
 {
-	Powers::const_iterator power = s_g->FindPower(g_currentPower);
-	const std::string buffer(rl_line_buffer,rl_point);
+	static const char *words[] = {"Promote", "Discard"};
+	Matches matches;
+	if (depth == 1)
+		arrayMatches(text, words, LIST_SIZE(words), matches);
+	return completionList(text, matches);
+}
 
-	if (power != s_g->_powers.end())
-	{
-		BOOST_FOREACH(auto i, power->first->_civCards._cards)
-		{
-			if (char *value = fillBuffer(i->_name, text, state))
-				return value;
-		}
-	} else
+char **completeFormat(const std::vector<std::string> &, const char *text, int depth)
+{
+	Matches matches;
+	switch (depth)
 	{
-		BOOST_FOREACH(auto i, s_g->_civcards)
-		{
-			char *value = NULL;
-			if (value = fillBuffer(i->_name, text, state))
-				return value;
-		}
+		case 1:
+			arrayMatches(text, formatList, LIST_SIZE(formatList), matches);
+			break;
 	}
-	return NULL;
+	return completionList(text, matches);
 }
-*/
-char *numberFill(const char *text, int state)
+
+char **completeBuy(const std::vector<std::string> &data, const char *text, int depth)
 {
-	const char *numbers[] = {"1","2","3","4","5","6","7","8","9"};
-	const int len = sizeof(numbers)/sizeof(const char *);
-	for(int i =0 ; i < len; ++i)
+	static const char *words[] = {"Free", "Auto"};
+	Matches matches;
+	switch (depth)
 	{
-		char *value = NULL;
-		if (value = fillBuffer(numbers[i], text, state))
-			return value;
+		case 1:
+			powerMatches(text, matches);
+			break;
+		case 2:
+			handMatches(data[1], text, matches);
+			numberMatches(text, matches);
+			arrayMatches(text, words, LIST_SIZE(words), matches);
+			break;
+		default:
+			handMatches(data[1], text, matches);
+			numberMatches(text, matches);
+			arrayMatches(text, words, LIST_SIZE(words), matches);
+			civNotMatches(data[1], text, matches);
+			break;
 	}
-	return NULL;
+	return completionList(text, matches);
 }
 
-char *multipleOfFive(const char *text, int state)
+char **completeWhere(const std::vector<std::string> &, const char *text, int depth)
 {
-	std::vector<std::string> numbers;
-	for(int i = 0; i < 10; ++i)
-	{
-		numbers.push_back(boost::lexical_cast<std::string>(i*5));
-	}
-	for(int i = 0; i < numbers.size(); ++i)
-	{
-		char *value = NULL;
-		if (value = fillBuffer(numbers[i], text, state))
-			return value;
-	}
-	return NULL;
+	Matches matches;
+	if (depth == 1)
+		trieMatches(activeGame()._names._cards, text, matches);
+	return completionList(text, matches);
 }
 
-char *listFill(const char *text, int state)
+char **completePlan(const std::vector<std::string> &, const char *text, int depth)
 {
-	const int len = sizeof(objectList)/sizeof(const char *);
-	for(int i = 0; i < len; ++i)
+	Matches matches;
+	switch (depth)
 	{
-		char *value = NULL;
-		if (value = fillBuffer(objectList[i], text, state))
-			return value;
+		case 1:
+			powerMatches(text, matches);
+			break;
+		case 2:
+			numberMatches(text, matches);
+			break;
 	}
-	return NULL;
+	return completionList(text, matches);
 }
 
-char **completeHelp(const std::vector<std::string> &, const char *text, int depth)
+char **completeSimulate(const std::vector<std::string> &, const char *text, int depth)
 {
+	static const char *words[] = {"Draw"};
+	Matches matches;
 	switch (depth)
 	{
 		case 1:
-		{
-			return rl_completion_matches(text, fillFromComplete);
+			arrayMatches(text, words, LIST_SIZE(words), matches);
+			break;
+		case 2:
+			powerMatches(text, matches);
+			break;
+		case 3:
+		case 4:
+			numberMatches(text, matches);
 			break;
-		}
 	}
-	return NULL;
+	return completionList(text, matches);
 }
 
-char *rulesFill(const char *text, int state)
+char **completeTrades(const std::vector<std::string> &, const char *text, int depth)
 {
-	const int numValues = sizeof(rulesList)/sizeof(const char *);
-	return fillFromArray(text, state, rulesList, numValues);
+	Matches matches;
+	if (depth == 1)
+		powerMatches(text, matches);
+	return completionList(text, matches);
 }
 
-char **completeBuy(const std::vector<std::string> &data, const char *text, int depth)
+// Power, then cards it holds up to For, then any card
+char **completeOffer(const std::vector<std::string> &data, const char *text, int depth)
 {
-	static const char *words[] = {"Free"};
-	switch (depth)
+	static const char *words[] = {"For"};
+	Matches matches;
+	bool wants = false;
+	for(int i = 2; i < depth && i < data.size(); ++i)
+		wants = wants || boost::iequals(data[i], "for");
+	if (depth == 1)
+		powerMatches(text, matches);
+	else if (wants)
+		trieMatches(activeGame()._names._cards, text, matches);
+	else
 	{
-		case 1:
-			return rl_completion_matches(text, countryFill);
-			break;
-		case 2:
-			{
-			g_currentPower = data[1];
-			g_fillFuncs += cardFill,numberFill,boost::bind(fillFromArray,_1,_2,words,1);
-			char ** value = rl_completion_matches(text, aggregateFill);
-			g_currentPower = std::string();
-			g_fillFuncs.clear();
-			return value;
-			break;
-			}
-		default:
-			{
-				g_currentPower = data[1];
-				g_fillFuncs += cardFill,numberFill,boost::bind(fillFromArray,_1,_2,words,1),civNotFill;
-				char **value = rl_completion_matches(text, aggregateFill);
-				g_currentPower = std::string();
-				g_fillFuncs.clear();
-				return value;
-				break;
-			}
+		handMatches(data[1], text, matches);
+		if (depth > 4)
+			arrayMatches(text, words, LIST_SIZE(words), matches);
 	}
+	return completionList(text, matches);
+}
 
-	return NULL;
+char **completeTurn(const std::vector<std::string> &, const char *text, int depth)
+{
+	Matches matches;
+	if (depth%2)
+		numberMatches(text, matches);
+	else
+		powerMatches(text, matches);
+	return completionList(text, matches);
 }
 
 char **completeCreate(const std::vector<std::string> &, const char *text, int depth)
@@ -390,7 +409,9 @@ char **completeCreate(const std::vector<std::string> &, const char *text, int de
 		}
 		case 3:
 		{
-			return rl_completion_matches(text, rulesFill);
+			Matches matches;
+			arrayMatches(text, rulesList, LIST_SIZE(rulesList), matches);
+			return completionList(text, matches);
 			break;
 		}
 	}
@@ -399,59 +420,48 @@ char **completeCreate(const std::vector<std::string> &, const char *text, int de
 
 char **completeCost(const std::vector<std::string> &data, const char *text, int depth)
 {
+	Matches matches;
 	switch (depth)
 	{
 		case 1:
-			{
-			g_fillFuncs += countryFill,civNotFill;
-			char **value = rl_completion_matches(text,aggregateFill);
-			g_fillFuncs.clear();
-			return value;
+			powerMatches(text, matches);
+			trieMatches(activeGame()._names._civcards, text, matches);
 			break;
-			}
 		case 2:
-			{
-			g_currentPower = data[1];
-			char **value = rl_completion_matches(text, civNotFill);
-			g_currentPower = std::string();
-			return value;
+			civNotMatches(data[1], text, matches);
 			break;
-			}
 	}
-	return NULL;
+	return completionList(text, matches);
 }
 
 char **completeDiscard(const std::vector<std::string> &data, const char *text, int depth)
 {
+	Matches matches;
 	switch(depth)
 	{
 		case 1:
-			return rl_completion_matches(text, countryFill);
+			powerMatches(text, matches);
 			break;
 		default:
-		{
-			g_currentPower = data[1];
-			char **value = rl_completion_matches(text, cardFill);
-			g_currentPower = std::string();
-			return value;
-		}
+			handMatches(data[1], text, matches);
 			break;
 	}
-	return NULL;
+	return completionList(text, matches);
 }
 
 char **completeDraw(const std::vector<std::string> &, const char *text, int depth)
 {
+	Matches matches;
 	switch(depth)
 	{
 		case 1:
-			return rl_completion_matches(text, countryFill);
+			powerMatches(text, matches);
 			break;
 		default:
-			return rl_completion_matches(text, numberFill);
+			numberMatches(text, matches);
 			break;
 	}
-	return NULL;
+	return completionList(text, matches);
 }
 
 char **completeImport(const std::vector<std::string> &, const char *text, int depth)
@@ -459,7 +469,11 @@ char **completeImport(const std::vector<std::string> &, const char *text, int de
 	switch(depth)
 	{
 		case 1:
-			return rl_completion_matches(text, importFill);
+		{
+			Matches matches;
+			arrayMatches(text, importList, LIST_SIZE(importList), matches);
+			return completionList(text, matches);
+		}
 		case 2:
 			return rl_completion_matches(text, rl_filename_completion_function);
 	}
@@ -478,178 +492,178 @@ char **completeExport(const std::vector<std::string> &, const char *text, int de
 
 char **completeHeld(const std::vector<std::string> &, const char *text, int depth)
 {
+	Matches matches;
 	switch(depth)
 	{
 		case 1:
-			g_fillFuncs += numberFill,countryFill;
-			char **value = rl_completion_matches(text,aggregateFill);
-			g_fillFuncs.clear();
-			return value;
+			numberMatches(text, matches);
+			powerMatches(text, matches);
+			break;
 	}
-	return NULL;
+	return completionList(text, matches);
 }
 
 char **completeSetPlayer(const std::vector<std::string> &, const char *text, int depth)
 {
+	Matches matches;
 	switch(depth)
 	{
 		case 1:
-			return rl_completion_matches(text,countryFill);
+			powerMatches(text, matches);
 			break;
 		case 2:
 			break;
 	}
-	return NULL;
+	return completionList(text, matches);
 }
 
 char **completeSet(const std::vector<std::string> &, const char *text, int depth)
 {
+	Matches matches;
 	switch(depth)
 	{
 		case 1:
-			return rl_completion_matches(text,setFill);
+			trieMatches(activeGame()._names._vars, text, matches);
 			break;
 	}
-	return NULL;
+	return completionList(text, matches);
 }
 
 char **completeInsert(const std::vector<std::string> &data, const char *text, int depth)
 {
+	Matches matches;
 	switch(depth)
 	{
 		case 1:
-		{
-			return rl_completion_matches(text, numberFill);
-		}
+			numberMatches(text, matches);
+			break;
 		case 2:
-		{
-			g_currentDeck = boost::lexical_cast<int>(data[1]);
-			char **value = rl_completion_matches(text, cardFill);
-			g_currentDeck = 0;
-			return value;
-		}
+			deckMatches(boost::lexical_cast<int>(data[1]), text, matches);
+			break;
 	}
-	return NULL;
+	return completionList(text, matches);
 }
 
 char **completeTrade(const std::vector<std::string> &data, const char *text, int depth)
 {
+	Matches matches;
 	switch(depth)
 	{
 		case 1:
-		{
-			return rl_completion_matches(text, countryFill);
-		}
+			powerMatches(text, matches);
+			break;
 		case 2:
 		case 3:
 		case 4:
-		{
-			g_currentPower = data[1];
-			char **value = rl_completion_matches(text, cardFill);
-			g_currentPower = std::string();
-			return value;
-		}
+			handMatches(data[1], text, matches);
+			break;
 		default:
 		{
-			Powers::const_iterator p2 = s_g->_powers.end();
 			for(int i = 5; i < depth; ++i)
 			{
-				p2 = s_g->FindPower(data[i]);
-				if (p2 != s_g->_powers.end())
+				Powers::const_iterator p2 = activeGame().FindPower(data[i]);
+				if (p2 != activeGame()._powers.end())
 				{
-					g_currentPower = p2->first->_name;
-					char **value = rl_completion_matches(text, cardFill);
-					g_currentPower = std::string();
-					return value;
+					handMatches(p2->first->_name, text, matches);
+					return completionList(text, matches);
 				}
 			}
 
-			g_currentPower = data[1];
-			g_fillFuncs += countryFill,cardFill;
-			char **value = rl_completion_matches(text, aggregateFill);
-			g_fillFuncs.clear();
-			g_currentPower = std::string();
-			return value;
+			powerMatches(text, matches);
+			handMatches(data[1], text, matches);
+			break;
 		}
 	}
-
-	return NULL;
+	return completionList(text, matches);
 }
 
 char **completeValue(const std::vector<std::string> &data, const char *text, int)
 {
-	g_fillFuncs += cardFill,numberFill;
-	char **value = rl_completion_matches(text, aggregateFill);
-	g_fillFuncs.clear();
-	return value;
+	Matches matches;
+	trieMatches(activeGame()._names._cards, text, matches);
+	numberMatches(text, matches);
+	return completionList(text, matches);
 }
 
 char **completeShuffleIn(const std::vector<std::string> &data, const char *text, int depth)
 {
+	Matches matches;
 	switch(depth)
 	{
 		case 1:
 		case 3:
-			return rl_completion_matches(text, numberFill);
+			numberMatches(text, matches);
+			break;
 		case 2:
-			return rl_completion_matches(text, typeFill);
+			arrayMatches(text, typeList, LIST_SIZE(typeList), matches);
+			break;
 		case 4:
 			return NULL;
 	}
 	
-	return NULL;
+	return completionList(text, matches);
 }
 
 char **completeList(const std::vector<std::string> &data, const char *text, int depth)
 {
+	Matches matches;
 	switch(depth)
 	{
 		case 1:
-		return rl_completion_matches(text, listFill);
-		break;
+			arrayMatches(text, objectList, LIST_SIZE(objectList), matches);
+			break;
 	}
-	return NULL;
+	return completionList(text, matches);
+}
+
+char **completeCount(const std::vector<std::string> &data, const char *text, int depth)
+{
+	static const char *words[] = {"values"};
+	Matches matches;
+	switch(depth)
+	{
+		case 1:
+			arrayMatches(text, objectList, LIST_SIZE(objectList), matches);
+			arrayMatches(text, words, LIST_SIZE(words), matches);
+			break;
+	}
+	return completionList(text, matches);
 }
 
 char **completeGive(const std::vector<std::string> &data, const char *text, int depth)
 {
 	static const char *words[] = {"Random"};
+	Matches matches;
 	switch(depth)
 	{
 		case 1:
 		case 2:
-			return rl_completion_matches(text, countryFill);
+			powerMatches(text, matches);
 			break;
 		case 3:
-		{
-			g_currentPower = data[1];
-			g_fillFuncs += cardFill, boost::bind(fillFromArray,_1,_2,words,1);
-			char **value = rl_completion_matches(text, aggregateFill);
-			g_fillFuncs.clear();
-			g_currentPower = std::string();
-			return value;
-		}
+			handMatches(data[1], text, matches);
+			arrayMatches(text, words, 1, matches);
+			break;
 	}
-	return NULL;
+	return completionList(text, matches);
 }
 
 char **completeGrant(const std::vector<std::string> &data, const char *text, int depth)
 {
+	Matches matches;
 	switch (depth)
 	{
 		case 1:
-			return rl_completion_matches(text, countryFill);
+			powerMatches(text, matches);
 			break;
 		case 2:
-			{
-			return rl_completion_matches(text, groupFill);
+			trieMatches(activeGame()._names._groups, text, matches);
 			break;
-			}
 		case 3:
-			return rl_completion_matches(text, multipleOfFive);
+			arrayMatches(text, fiveList, LIST_SIZE(fiveList), matches);
 			break;
 	}
-	return NULL;
+	return completionList(text, matches);
 }
 
 char **completeNULL(const std::vector<std::string> &, const char *, int)
@@ -664,22 +678,37 @@ REG_COMP(Discard, completeDiscard);
 REG_COMP(Draw, completeDraw);
 REG_COMP(Dump, completeExport);
 REG_COMP(Export, completeExport);
+REG_COMP(Format, completeFormat);
 REG_COMP(Import, completeImport);
 REG_COMP(Held, completeHeld);
 REG_COMP(SetPlayer, completeSetPlayer);
 REG_COMP(Set, completeSet);
 REG_COMP(Save, completeNULL);
+REG_COMP(Fork, completeFork);
+REG_COMP(Undo, completeNULL);
+REG_COMP(Redo, completeNULL);
 REG_COMP(Quit, completeNULL);
 REG_COMP(Abort, completeNULL);
 REG_COMP(Trade, completeTrade);
 REG_COMP(Reshuffle, completeNULL);
+REG_COMP(Turn, completeTurn);
+REG_COMP(Where, completeWhere);
+REG_COMP(Check, completeNULL);
+REG_COMP(Plan, completePlan);
+REG_COMP(Simulate, completeSimulate);
+REG_COMP(Trades, completeTrades);
+REG_COMP(Offer, completeOffer);
+REG_COMP(Offers, completeTrades);
+REG_COMP(Withdraw, completeNULL);
+REG_COMP(Match, completeNULL);
 REG_COMP(Value, completeValue);
 REG_COMP(List, completeList);
-REG_COMP(Count, completeList);
+REG_COMP(Count, completeCount);
 REG_COMP(Give, completeGive);
 REG_COMP(Grant, completeGrant);
 REG_COMP(ShuffleIn, completeShuffleIn);
 REG_COMP(Help, completeHelp);
+REG_COMP(Stats, completeNULL);
 
 char **partialComplete(const std::vector<std::string> &target, const char *text)
 {
@@ -698,7 +727,11 @@ char **dbCompletion(const char *text, int start, int end)
 		return NULL;
 	
 	if (start == 0)
-		matches = rl_completion_matches(text, fillFromComplete);
+	{
+		Matches commands;
+		commandMatches(text, commands);
+		matches = completionList(text, commands);
+	}
 	else
 		matches = partialComplete(target, text);
 	
@@ -720,43 +753,125 @@ int main(int argc, char *argv[])
 		return ErrQuit;
 	}
 
+	Journal journal(argv[1]);
+	journal.Begin();
 	s_g.reset(new Game(argv[1]));
+	CheckCards(*s_g, std::cerr);
+	s_candidates.Refresh(*s_g);
 	//loadHelpText(*ht);
 
+	boost::scoped_ptr<Rng> forkRng; // Starts as the session generator
+	std::vector<std::string> forked; // Journaled if the fork is promoted
+
 	while(true)
 	{
 		char *line(NULL);
-		line = readline((cmd.leaf() + " > ").c_str());
+		line = readline((cmd.leaf() + (s_fork?" fork":"") + " > ").c_str());
 		if (line && *line)
 		{
 			add_history(line);
-			int error = ParseLine(line,*s_g, std::cout);
+			Game &g = activeGame();
+			int error;
+			{
+				boost::mutex::scoped_lock lock(s_gameLock);
+				ScopedRng rng(s_fork?*forkRng:CurrentRng());
+				error = ParseLine(line, g, std::cout);
+			}
+			if (error == ErrNone && Mutates(line))
+			{
+				if (s_fork)
+					forked.push_back(line);
+				else
+					journal.Record(line);
+				s_candidates.Refresh(g);
+			}
 			free(line);
 			
 			if (error == ErrQuit)
 				break;
+			if (error == ErrFork)
+			{
+				if (s_fork)
+				{
+					std::cerr << "Already forked" << std::endl;
+					continue;
+				}
+				s_fork = s_g->Fork();
+				forkRng.reset(new Rng(SessionRng()));
+				continue;
+			}
+			// A fork is only a copy, failing on it doesn't end the session
+			if (s_fork && !Continuable(error))
+			{
+				std::cerr << "Error " << error << ", fork discarded" << std::endl;
+				error = ErrDiscard;
+			}
+			if (error == ErrPromote || error == ErrDiscard)
+			{
+				if (!s_fork)
+				{
+					std::cerr << "Not forked" << std::endl;
+					continue;
+				}
+				// The cache may still be reading the game that goes away
+				s_candidates.Wait();
+				if (error == ErrPromote)
+				{
+					// Replaying the fork's commands from the session
+					// generator as it was at the fork draws the same cards
+					s_fork->Promote(*s_g);
+					s_g = s_fork;
+					SessionRng() = *forkRng;
+					BOOST_FOREACH(auto &i, forked)
+						journal.Record(i);
+				}
+				s_fork.reset();
+				forkRng.reset();
+				forked.clear();
+				s_candidates.Refresh(*s_g);
+				continue;
+			}
 			if (error == ErrSave)
 			{
-				s_g.reset();
-				s_g.reset(new Game(argv[1]));
+				if (s_fork)
+				{
+					std::cerr << "Forked, promote or discard the fork before saving" << std::endl;
+					continue;
+				}
+				s_g->Save();
+				journal.Commit();
 				continue;
 			}
 			if (error != ErrNone)
 				std::cerr << "Error " << error << std::endl;
-			if (error > ErrQuit)
+			if (!Continuable(error))
 			{
+				s_candidates.Wait();
 				s_g->Abandon();
+				RenderStats(std::cerr);
 				return error;
 			}
 		}
 	}
+	s_candidates.Wait();
+	if (s_fork)
+		std::cerr << "Fork discarded" << std::endl;
+	if (!s_g->WaitForSave())
+		std::cerr << "Last save failed, saving again on exit" << std::endl;
+	// The exit export sets the "export" variable the game is saved with,
+	// so it goes in the journal before the journal is committed
+	int error = ErrNone;
 	if (argc == 3 || !s_g->_vars["export"].empty())
 	{
 		std::string d = s_g->_vars["export"].empty()?argv[2]:"default";
-		int error = ParseLine(std::string("export ")+d,*s_g, std::cout);
-		if (error != ErrNone)
+		const std::string line = std::string("export ")+d;
+		error = ParseLine(line, *s_g, std::cout);
+		if (error == ErrNone)
+			journal.Record(line);
+		else
 			std::cerr << "Export Error " << error << std::endl;
-		return error;
 	}
-	return ErrNone;
+	journal.Commit();
+	RenderStats(std::cerr);
+	return error;
 }
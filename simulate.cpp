@@ -0,0 +1,142 @@
+#include "simulate.h"
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+
+#include <algorithm>
+
+namespace
+{
+	const int BlockSize = 4096;
+
+	// The decks flattened to card ids and the hand to counts by id, shared
+	// read only by every block
+	struct DrawSource
+	{
+		std::vector<std::vector<int> > _decks;
+		std::vector<int> _held;
+		std::vector<int> _deckOf; // Deck of each normal card, 0 for calamities
+		int _heldValue;
+	};
+
+	// Counts of one block, merged once every block is done
+	struct BlockOdds
+	{
+		std::vector<int> _calamities;
+		std::vector<int> _byCalamity;
+	};
+
+	void RunBlock(const DrawSource &source, Rng::Seed seed, int iterations, std::vector<int> &values, std::vector<BlockOdds> &blocks, int block)
+	{
+		Rng rng(seed, block);
+		BlockOdds &odds = blocks[block];
+		odds._calamities.assign(source._decks.size()+1, 0);
+		odds._byCalamity.assign(source._held.size(), 0);
+		std::vector<int> counts(source._held);
+		std::vector<int> drawn;
+		drawn.reserve(source._decks.size());
+
+		const int end = std::min(iterations, (block+1)*BlockSize);
+		for(int i = block*BlockSize; i < end; ++i)
+		{
+			int value = source._heldValue;
+			int calamities = 0;
+			BOOST_FOREACH(auto &deck, source._decks)
+			{
+				if (deck.empty())
+					continue;
+				const int id = deck[rng.Below(deck.size())];
+				const int worth = source._deckOf[id];
+				if (!worth)
+				{
+					++calamities;
+					++odds._byCalamity[id];
+					continue;
+				}
+				// A set of n is worth n*n*deck, one more card adds (2n+1)*deck
+				value += (2*counts[id]+1)*worth;
+				++counts[id];
+				drawn.push_back(id);
+			}
+			values[i] = value;
+			++odds._calamities[calamities];
+
+			BOOST_FOREACH(auto id, drawn)
+				--counts[id];
+			drawn.clear();
+		}
+	}
+}
+
+int DrawOdds::Percentile(double p) const
+{
+	if (_values.empty())
+		return 0;
+	return _values[std::min<size_t>(_values.size()*p, _values.size()-1)];
+}
+
+double DrawOdds::Mean() const
+{
+	double sum = 0;
+	BOOST_FOREACH(auto value, _values)
+		sum += value;
+	return _values.empty()?0:sum/_values.size();
+}
+
+void SimulateDraws(const Game &g, const Power &p, int cards, int iterations, Rng::Seed seed, DrawOdds &odds, ThreadPool &pool)
+{
+	DrawSource source;
+	source._held.assign(g._cardIds.size(), 0);
+	source._deckOf.assign(g._cardIds.size(), 0);
+	BOOST_FOREACH(auto card, g._cardIds)
+	{
+		if (card->_type == Card::Normal)
+			source._deckOf[card->_id] = card->_deck;
+	}
+	BOOST_FOREACH(auto card, p._hand)
+		++source._held[card->_id];
+	source._heldValue = p.Score()._handValue;
+
+	for(int i = 1; i <= cards && i < g._decks.size(); ++i)
+	{
+		source._decks.push_back(std::vector<int>());
+		std::vector<int> &deck = source._decks.back();
+		if (!g._decks[i].empty())
+		{
+			BOOST_FOREACH(auto card, g._decks[i])
+				deck.push_back(card->_id);
+		}
+		else if (i < g._discards.size())
+		{
+			BOOST_FOREACH(auto card, g._discards[i])
+				deck.push_back(card->_id);
+		}
+	}
+
+	odds._iterations = iterations;
+	odds._values.assign(iterations, 0);
+	const int blocks = (iterations+BlockSize-1)/BlockSize;
+	std::vector<BlockOdds> results(blocks);
+	pool.ParallelFor(blocks, boost::bind(RunBlock, boost::cref(source), seed, iterations,
+		boost::ref(odds._values), boost::ref(results), _1));
+	std::sort(odds._values.begin(), odds._values.end());
+
+	odds._calamities.assign(source._decks.size()+1, 0);
+	std::vector<int> byCalamity(g._cardIds.size());
+	BOOST_FOREACH(auto &block, results)
+	{
+		for(int i = 0; i < block._calamities.size(); ++i)
+			odds._calamities[i] += block._calamities[i];
+		for(int i = 0; i < block._byCalamity.size(); ++i)
+			byCalamity[i] += block._byCalamity[i];
+	}
+	while(odds._calamities.size() > 1 && !odds._calamities.back())
+		odds._calamities.pop_back();
+
+	odds._byCalamity.clear();
+	for(int i = 0; i < byCalamity.size(); ++i)
+	{
+		if (byCalamity[i])
+			odds._byCalamity.push_back(std::make_pair(g._cardIds[i], byCalamity[i]));
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef SIMULATE_H__
+#define SIMULATE_H__
+
+#include "db.h"
+#include "pool.h"
+#include "rng.h"
+
+#include <vector>
+
+// What a draw brings a power over many simulated draws
+struct DrawOdds
+{
+	int _iterations;
+	std::vector<int> _values; // Hand value after each draw, sorted
+	std::vector<int> _calamities; // Draws by the number of calamities in them
+	std::vector<std::pair<CardP, int> > _byCalamity; // Draws with each calamity
+
+	int Percentile(double p) const;
+	double Mean() const;
+};
+
+// Most draws one simulation may take, the hand value of every draw is kept
+const int MaxSimulatedDraws = 10000000;
+
+// Draws one card from each of the first cards decks into the power's hand,
+// iterations times.  Players don't know the order of a deck so each draw
+// picks any of its cards, or of its discards once it's empty as a reshuffle
+// would.  Draws are split in blocks with a stream of seed each, so the odds
+// depend on the seed and not on the number of threads.
+void SimulateDraws(const Game &g, const Power &p, int cards, int iterations, Rng::Seed seed, DrawOdds &odds, ThreadPool &pool = ThreadPool::Shared());
+
+#endif
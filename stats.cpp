@@ -0,0 +1,175 @@
+#include "stats.h"
+#include "output.h"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
+
+#include <cstdlib>
+#include <ctime>
+#include <iomanip>
+#include <map>
+#include <new>
+
+static __thread unsigned long long t_allocations = 0;
+static __thread unsigned long long t_bytes = 0;
+
+void *operator new(std::size_t size)
+{
+	++t_allocations;
+	t_bytes += size;
+	void *p = std::malloc(size?size:1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void *operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *p) throw()
+{
+	std::free(p);
+}
+
+void operator delete[](void *p) throw()
+{
+	std::free(p);
+}
+
+void operator delete(void *p, std::size_t) throw()
+{
+	std::free(p);
+}
+
+void operator delete[](void *p, std::size_t) throw()
+{
+	std::free(p);
+}
+
+unsigned long long AllocationCount()
+{
+	return t_allocations;
+}
+
+unsigned long long AllocationBytes()
+{
+	return t_bytes;
+}
+
+void ChargeAllocations(unsigned long long allocations, unsigned long long bytes)
+{
+	t_allocations += allocations;
+	t_bytes += bytes;
+}
+
+static unsigned long long now()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec*1000000000ULL + t.tv_nsec;
+}
+
+CommandStats::CommandStats():_calls(0),_nanoseconds(0),_maxNanoseconds(0),_allocations(0),_bytes(0)
+{
+	for(int i = 0; i < Buckets; ++i)
+		_histogram[i] = 0;
+}
+
+void CommandStats::Record(unsigned long long nanoseconds, unsigned long long allocations, unsigned long long bytes)
+{
+	++_calls;
+	_nanoseconds += nanoseconds;
+	_allocations += allocations;
+	_bytes += bytes;
+
+	unsigned long long previous = _maxNanoseconds;
+	while(previous < nanoseconds && !_maxNanoseconds.compare_exchange_weak(previous, nanoseconds))
+		;
+
+	int bucket = 0;
+	for(unsigned long long micro = nanoseconds/1000; micro && bucket < Buckets-1; micro >>= 1)
+		++bucket;
+	++_histogram[bucket];
+}
+
+// Upper bound, in microseconds, of the bucket holding the given fraction of calls
+unsigned long long CommandStats::Percentile(double fraction) const
+{
+	const unsigned long long target = (unsigned long long)(fraction*_calls);
+	unsigned long long seen = 0;
+	for(int i = 0; i < Buckets; ++i)
+	{
+		seen += _histogram[i];
+		if (seen > target)
+			return 1ULL << i;
+	}
+	return 1ULL << (Buckets-1);
+}
+
+typedef std::map<std::string, CommandStats> StatsTable;
+
+static StatsTable &table()
+{
+	static StatsTable s_table;
+	return s_table;
+}
+
+// Entries are only added while commands register, before main, so reading the
+// table afterwards needs no lock
+CommandStats &StatsFor(const std::string &command)
+{
+	return table()[boost::to_lower_copy(command)];
+}
+
+void RenderStats(std::ostream &out)
+{
+	if (Structured())
+	{
+		RecordWriter w(out);
+		BOOST_FOREACH(auto &i, table())
+		{
+			const CommandStats &s = i.second;
+			w.Record("stats")
+				.Field("command", i.first)
+				.Field("calls", s._calls.load())
+				.Field("totalUs", s._nanoseconds/1000)
+				.Field("maxUs", s._maxNanoseconds/1000)
+				.Field("p50Us", s.Percentile(0.5))
+				.Field("p99Us", s.Percentile(0.99))
+				.Field("allocations", s._allocations.load())
+				.Field("bytes", s._bytes.load());
+		}
+		return;
+	}
+
+	out << "Command\tCalls\tTotal ms\tMean us\tMax us\t<p50 us\t<p99 us\tAllocs\tBytes" << std::endl;
+	BOOST_FOREACH(auto &i, table())
+	{
+		const CommandStats &s = i.second;
+		if (!s._calls)
+			continue;
+		out << i.first << '\t'
+			<< s._calls << '\t'
+			<< std::fixed << std::setprecision(3) << s._nanoseconds/1e6 << '\t'
+			<< s._nanoseconds/1000/s._calls << '\t'
+			<< s._maxNanoseconds/1000 << '\t'
+			<< s.Percentile(0.5) << '\t'
+			<< s.Percentile(0.99) << '\t'
+			<< s._allocations << '\t'
+			<< s._bytes << std::endl;
+	}
+}
+
+ScopedStats::ScopedStats(CommandStats &stats):
+	_stats(stats),
+	_start(now()),
+	_allocations(t_allocations),
+	_bytes(t_bytes)
+{}
+
+ScopedStats::~ScopedStats()
+{
+	_stats.Record(now()-_start, t_allocations-_allocations, t_bytes-_bytes);
+}
@@ -0,0 +1,52 @@
+#ifndef STATS_H__
+#define STATS_H__
+
+#include <atomic>
+#include <ostream>
+#include <string>
+
+// Latency and heap usage of one command.  Counters are atomics so commands can
+// be recorded from any thread without taking a lock.
+class CommandStats
+{
+	public:
+		static const int Buckets = 24; // Bucket i holds calls taking < 2^i microseconds
+
+		CommandStats();
+		void Record(unsigned long long nanoseconds, unsigned long long allocations, unsigned long long bytes);
+		unsigned long long Percentile(double fraction) const;
+
+		std::atomic<unsigned long long> _calls;
+		std::atomic<unsigned long long> _nanoseconds;
+		std::atomic<unsigned long long> _maxNanoseconds;
+		std::atomic<unsigned long long> _allocations;
+		std::atomic<unsigned long long> _bytes;
+		std::atomic<unsigned long long> _histogram[Buckets];
+};
+
+// Call while registering a command, the table isn't locked
+CommandStats &StatsFor(const std::string &command);
+void RenderStats(std::ostream &out);
+
+// Heap usage of the calling thread since it started
+unsigned long long AllocationCount();
+unsigned long long AllocationBytes();
+// Adds another thread's heap usage to the calling thread's, for work done on
+// its behalf
+void ChargeAllocations(unsigned long long allocations, unsigned long long bytes);
+
+// Times the enclosing scope and records it against the command
+class ScopedStats
+{
+	public:
+		explicit ScopedStats(CommandStats &stats);
+		~ScopedStats();
+
+	private:
+		CommandStats &_stats;
+		unsigned long long _start;
+		unsigned long long _allocations;
+		unsigned long long _bytes;
+};
+
+#endif
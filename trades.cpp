@@ -0,0 +1,200 @@
+#include "trades.h"
+
+#include <boost/foreach.hpp>
+
+#include <algorithm>
+#include <limits>
+
+namespace
+{
+	const int TradeSize = 3;
+
+	// Commodity cards of a hand with how many of each are held
+	typedef std::vector<std::pair<CardP, int> > Histogram;
+
+	// Three cards one power could hand over, as positions in its histogram
+	struct Option
+	{
+		int _sets[TradeSize];
+		int _loss; // Change in its own hand's value, never positive
+		int _gain; // Change in the partner's, found per pair
+	};
+
+	void histogram(const Hand &hand, Histogram &sets)
+	{
+		CardP currentCard;
+		BOOST_FOREACH(auto i, hand)
+		{
+			if (currentCard == i)
+				continue;
+			currentCard = i;
+			if (currentCard->_type == Card::Normal)
+				sets.push_back(std::make_pair(currentCard, (int)hand.count(currentCard)));
+		}
+	}
+
+	// Every way to pick TradeSize cards, set positions in ascending order.
+	// A set of n is worth n*n*deck, so taking one more card from it when k
+	// are already gone changes the value by (1-2(n-k))*deck.
+	void options(const Histogram &sets, std::vector<Option> &found, Option &option, int first, int picked)
+	{
+		if (picked == TradeSize)
+		{
+			found.push_back(option);
+			return;
+		}
+		for(int i = first; i < sets.size(); ++i)
+		{
+			const int taken = picked && option._sets[picked-1] == i?
+				std::count(option._sets, option._sets+picked, i):0;
+			if (taken == sets[i].second)
+				continue;
+			const int delta = (1-2*(sets[i].second-taken))*sets[i].first->_deck;
+			option._sets[picked] = i;
+			option._loss += delta;
+			options(sets, found, option, i, picked+1);
+			option._loss -= delta;
+		}
+	}
+
+	// What the cards of option add to a hand holding counts of them, by card id
+	int gain(const Histogram &sets, const Option &option, const std::vector<int> &counts)
+	{
+		int value = 0;
+		int added[TradeSize] = {0};
+		for(int i = 0; i < TradeSize; ++i)
+		{
+			const CardP &card = sets[option._sets[i]].first;
+			// Sets are ascending so repeats of a card are next to each other
+			added[i] = i && option._sets[i-1] == option._sets[i]?added[i-1]+1:0;
+			value += (2*(counts[card->_id]+added[i])+1)*card->_deck;
+		}
+		return value;
+	}
+
+	bool shareCard(const Histogram &lsets, const Option &l, const Histogram &rsets, const Option &r)
+	{
+		for(int i = 0; i < TradeSize; ++i)
+		{
+			for(int j = 0; j < TradeSize; ++j)
+			{
+				if (lsets[l._sets[i]].first == rsets[r._sets[j]].first)
+					return true;
+			}
+		}
+		return false;
+	}
+
+	bool byGain(const Option &l, const Option &r)
+	{
+		return l._gain > r._gain;
+	}
+
+	bool better(const TradeOffer &l, const TradeOffer &r)
+	{
+		const int lmin = std::min(l._fromGain, l._toGain), rmin = std::min(r._fromGain, r._toGain);
+		if (lmin != rmin)
+			return lmin > rmin;
+		return l._fromGain+l._toGain > r._fromGain+r._toGain;
+	}
+
+	struct Side
+	{
+		PowerP _power;
+		Histogram _sets;
+		std::vector<Option> _options;
+		int _leastLoss; // Of any option
+	};
+}
+
+void FindTrades(const Game &g, const PowerP &power, std::vector<TradeOffer> &offers)
+{
+	std::vector<Side> sides(g._powerIds.size());
+	for(int i = 0; i < sides.size(); ++i)
+	{
+		Side &side = sides[i];
+		side._power = g._powerIds[i];
+		histogram(side._power->_hand, side._sets);
+		Option option = {{0}, 0, 0};
+		options(side._sets, side._options, option, 0, 0);
+		side._leastLoss = std::numeric_limits<int>::min();
+		BOOST_FOREACH(auto &o, side._options)
+			side._leastLoss = std::max(side._leastLoss, o._loss);
+	}
+
+	std::vector<int> counts(g._cardIds.size());
+	for(int a = 0; a < sides.size(); ++a)
+	{
+		for(int b = a+1; b < sides.size(); ++b)
+		{
+			if (power && sides[a]._power != power && sides[b]._power != power)
+				continue;
+			Side &from = sides[a], &to = sides[b];
+			if (from._options.empty() || to._options.empty())
+				continue;
+
+			// What each side's cards are worth to the other
+			BOOST_FOREACH(auto &set, to._sets)
+				counts[set.first->_id] = set.second;
+			BOOST_FOREACH(auto &o, from._options)
+				o._gain = gain(from._sets, o, counts);
+			BOOST_FOREACH(auto &set, to._sets)
+				counts[set.first->_id] = 0;
+			BOOST_FOREACH(auto &set, from._sets)
+				counts[set.first->_id] = set.second;
+			BOOST_FOREACH(auto &o, to._options)
+				o._gain = gain(to._sets, o, counts);
+			BOOST_FOREACH(auto &set, from._sets)
+				counts[set.first->_id] = 0;
+			std::sort(from._options.begin(), from._options.end(), byGain);
+			std::sort(to._options.begin(), to._options.end(), byGain);
+
+			// Both lists are by falling gain to the other side, so once one
+			// side can't beat the best smaller gain so far nothing further
+			// down its list can either
+			int best = 0, bestSum = 0;
+			const Option *gives = NULL, *gets = NULL;
+			BOOST_FOREACH(auto &give, from._options)
+			{
+				const int most = give._gain+to._leastLoss;
+				if (most < best || most <= 0)
+					break;
+				BOOST_FOREACH(auto &get, to._options)
+				{
+					const int fromGain = give._loss+get._gain;
+					if (fromGain < best || fromGain <= 0)
+						break;
+					const int toGain = get._loss+give._gain;
+					if (toGain <= 0)
+						continue;
+					const int least = std::min(fromGain, toGain);
+					if (least < best || (least == best && fromGain+toGain <= bestSum))
+						continue;
+					// Swapping copies of the same card isn't a trade, and the
+					// gains above assume the cards differ
+					if (shareCard(from._sets, give, to._sets, get))
+						continue;
+					best = least;
+					bestSum = fromGain+toGain;
+					gives = &give;
+					gets = &get;
+				}
+			}
+			if (!gives)
+				continue;
+
+			TradeOffer offer;
+			offer._from = from._power;
+			offer._to = to._power;
+			for(int i = 0; i < TradeSize; ++i)
+			{
+				offer._gives.insert(from._sets[gives->_sets[i]].first);
+				offer._gets.insert(to._sets[gets->_sets[i]].first);
+			}
+			offer._fromGain = gives->_loss+gets->_gain;
+			offer._toGain = gets->_loss+gives->_gain;
+			offers.push_back(offer);
+		}
+	}
+	std::stable_sort(offers.begin(), offers.end(), better);
+}
@@ -0,0 +1,24 @@
+#ifndef TRADES_H__
+#define TRADES_H__
+
+#include "db.h"
+
+#include <vector>
+
+// Three commodity cards each way that leave both powers' hands worth more
+struct TradeOffer
+{
+	PowerP _from;
+	PowerP _to;
+	Hand _gives; // From _from to _to
+	Hand _gets;
+	int _fromGain;
+	int _toGain;
+};
+
+// The best trade for every pair of powers, or every pair with power when it
+// isn't NULL.  Best is the trade whose smaller gain is largest.  Offers come
+// out best first.
+void FindTrades(const Game &g, const PowerP &power, std::vector<TradeOffer> &offers);
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef TRIE_H__
+#define TRIE_H__
+
+#include <boost/algorithm/string.hpp>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Case insensitive prefix index from names to values.  Each entry keeps the
+// name with its spaces already escaped the way the shell expects them, so a
+// lookup only costs the length of the prefix plus the size of the answer.
+template<typename T> class PrefixTrie
+{
+	public:
+		typedef std::pair<std::string, T> Entry;
+
+	private:
+		struct Node
+		{
+			std::map<char, int> _children;
+			std::vector<Entry> _entries;
+		};
+		std::vector<Node> _nodes;
+
+		int Walk(const std::string &key) const
+		{
+			int node = 0;
+			for(auto c = key.begin(); c != key.end(); ++c)
+			{
+				auto next = _nodes[node]._children.find(*c);
+				if (next == _nodes[node]._children.end())
+					return -1;
+				node = next->second;
+			}
+			return node;
+		}
+
+		template<typename Func> void VisitNode(int node, Func &f) const
+		{
+			for(auto i = _nodes[node]._entries.begin(); i != _nodes[node]._entries.end(); ++i)
+				f(*i);
+			for(auto i = _nodes[node]._children.begin(); i != _nodes[node]._children.end(); ++i)
+				VisitNode(i->second, f);
+		}
+
+	public:
+		PrefixTrie():_nodes(1){}
+
+		void Insert(const std::string &name, const T &value)
+		{
+			const std::string key = boost::to_lower_copy(name);
+			int node = 0;
+			for(auto c = key.begin(); c != key.end(); ++c)
+			{
+				auto next = _nodes[node]._children.find(*c);
+				if (next != _nodes[node]._children.end())
+				{
+					node = next->second;
+					continue;
+				}
+				const int child = _nodes.size();
+				_nodes.push_back(Node());
+				_nodes[node]._children[*c] = child;
+				node = child;
+			}
+			_nodes[node]._entries.push_back(Entry(boost::replace_all_copy(name, " ", "\\ "), value));
+		}
+
+		bool Erase(const std::string &name, const T &value)
+		{
+			const int node = Walk(boost::to_lower_copy(name));
+			if (node < 0)
+				return false;
+			std::vector<Entry> &entries = _nodes[node]._entries;
+			for(auto i = entries.begin(); i != entries.end(); ++i)
+			{
+				if (i->second == value)
+				{
+					entries.erase(i);
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// Calls f(const Entry &) for every entry whose name starts with prefix
+		template<typename Func> void Visit(const std::string &prefix, Func f) const
+		{
+			const int node = Walk(boost::to_lower_copy(prefix));
+			if (node >= 0)
+				VisitNode(node, f);
+		}
+
+		void Clear()
+		{
+			_nodes.clear();
+			_nodes.push_back(Node());
+		}
+};
+
+#endif
@@ -0,0 +1,218 @@
+#include "db.h"
+
+#include <boost/foreach.hpp>
+
+void UndoLog::Begin(const std::string &line)
+{
+	_current.reset(new Group);
+	_current->_line = line;
+}
+
+void UndoLog::End()
+{
+	if (_current && !_current->_ops.empty())
+	{
+		Push(_undo, _current);
+		_redo.clear();
+	}
+	_current.reset();
+}
+
+void UndoLog::Forget()
+{
+	_undo.clear();
+	_redo.clear();
+	_current.reset();
+}
+
+void UndoLog::Push(Groups &groups, const GroupP &group)
+{
+	groups.push_back(group);
+	if (groups.size() > MaxCommands)
+		groups.pop_front();
+}
+
+UndoLog::Op &UndoLog::Add(Kind kind, int where, int n, int index)
+{
+	const Op op = {kind, where, n, index, CardP()};
+	_current->_ops.push_back(op);
+	return _current->_ops.back();
+}
+
+void UndoLog::Cards(CardLedger::Location where, const CardP &card, int n)
+{
+	if (!_current)
+		return;
+	// Hands and piles are multisets, only the power or deck is needed
+	Add(CardsOp, where._index, n, where._kind)._card = card;
+}
+
+void UndoLog::DeckFront(int deck, const CardP &card, int n)
+{
+	if (_current)
+		Add(DeckFrontOp, deck, n)._card = card;
+}
+
+void UndoLog::DeckEnd(int deck, const Deck &cards, int n)
+{
+	if (!_current || cards.empty())
+		return;
+	Add(DeckEndOp, deck, n, _current->_piles.size());
+	_current->_piles.push_back(cards);
+}
+
+void UndoLog::CivCard(int power, const CivCardP &card, int n)
+{
+	if (!_current)
+		return;
+	Add(CivCardOp, power, n, _current->_civCards.size());
+	_current->_civCards.push_back(card);
+}
+
+void UndoLog::Credits(int power, int group, int n)
+{
+	if (_current && n)
+		Add(CreditsOp, power, n, group);
+}
+
+void UndoLog::Variable(const std::string &name, const std::string &before)
+{
+	if (!_current)
+		return;
+	Add(VariableOp, 0, 0, _current->_names.size());
+	_current->_names.push_back(name);
+	_current->_names.push_back(before);
+}
+
+void UndoLog::Assign(int power, const PlayerP &before)
+{
+	if (!_current)
+		return;
+	Add(AssignOp, power, 0, _current->_players.size());
+	_current->_players.push_back(before);
+}
+
+void UndoLog::Post(const OfferP &offer, int n)
+{
+	if (!_current || !offer)
+		return;
+	Add(PostOp, 0, n, _current->_offers.size());
+	_current->_offers.push_back(offer);
+}
+
+bool UndoLog::Undo(Game &g, std::string &line)
+{
+	return Reverse(g, _undo, _redo, line);
+}
+
+bool UndoLog::Redo(Game &g, std::string &line)
+{
+	return Reverse(g, _redo, _undo, line);
+}
+
+// Runs the newest group of from backwards, what that changes is recorded as
+// the group to reverse it again
+bool UndoLog::Reverse(Game &g, Groups &from, Groups &to, std::string &line)
+{
+	_current.reset();
+	if (from.empty())
+		return false;
+	const GroupP group = from.back();
+	from.pop_back();
+
+	_current.reset(new Group);
+	_current->_line = line = group->_line;
+	for(auto op = group->_ops.rbegin(); op != group->_ops.rend(); ++op)
+		Reverse(g, *group, *op);
+	Push(to, _current);
+	_current.reset();
+	return true;
+}
+
+// Each case makes the opposite change and records it
+void UndoLog::Reverse(Game &g, const Group &group, const Op &op)
+{
+	switch(op._kind)
+	{
+		case CardsOp:
+		{
+			const CardLedger::Location where(CardLedger::Kind(op._index), op._where);
+			if (where._kind == CardLedger::InHand || where._kind == CardLedger::InStaging)
+			{
+				g._powerIds[op._where]->Adjust(op._card, where._kind, -op._n);
+				break;
+			}
+			Hand &pile = g._discards[op._where];
+			for(int i = 0; i < -op._n; ++i)
+				pile.insert(op._card);
+			for(int i = 0; i < op._n; ++i)
+				pile.erase(pile.find(op._card));
+			g._ledger.Add(op._card, where, -op._n);
+			Cards(where, op._card, -op._n);
+			break;
+		}
+		case DeckFrontOp:
+		{
+			Deck &deck = g._decks[op._where];
+			if (op._n < 0)
+				deck.push_front(op._card);
+			else
+				deck.pop_front();
+			g._ledger.Add(op._card, CardLedger::Location(CardLedger::InDeck, op._where), -op._n);
+			DeckFront(op._where, op._card, -op._n);
+			break;
+		}
+		case DeckEndOp:
+		{
+			Deck &deck = g._decks[op._where];
+			const Deck &cards = group._piles[op._index];
+			if (op._n > 0)
+				deck.erase(deck.end()-cards.size(), deck.end());
+			else
+				deck.insert(deck.end(), cards.begin(), cards.end());
+			BOOST_FOREACH(auto card, cards)
+				g._ledger.Add(card, CardLedger::Location(CardLedger::InDeck, op._where), -op._n);
+			DeckEnd(op._where, cards, -op._n);
+			break;
+		}
+		case CivCardOp:
+		{
+			const PowerP &power = g._powerIds[op._where];
+			if (op._n > 0)
+				power->RemoveCivCard(group._civCards[op._index]);
+			else
+				power->AddCivCard(group._civCards[op._index]);
+			break;
+		}
+		case CreditsOp:
+			g._powerIds[op._where]->_civCards._bonusCredits[op._index] -= op._n;
+			Credits(op._where, op._index, -op._n);
+			break;
+		case VariableOp:
+		{
+			const std::string &name = group._names[op._index];
+			std::string &value = g._vars[name];
+			Variable(name, value);
+			value = group._names[op._index+1];
+			g.ResolveRules();
+			break;
+		}
+		case AssignOp:
+		{
+			PlayerP &player = g._powers[g._powerIds[op._where]];
+			Assign(op._where, player);
+			player = group._players[op._index];
+			break;
+		}
+		case PostOp:
+		{
+			const OfferP &offer = group._offers[op._index];
+			if (op._n > 0)
+				g._offers.Withdraw(offer->_id);
+			else
+				g._offers.Restore(offer);
+			Post(offer, -op._n);
+			break;
+		}
+	}
+}
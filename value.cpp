@@ -10,13 +10,13 @@ int main(int argc, char *argv[])
 	BOOST_FOREACH(auto power, g._powers)
 	{
 		std::cout << power.first->_name 
-			<< '\t' << ValueHand(power.first->_hand) << '\t';
+			<< '\t' << power.first->Score()._handValue << '\t';
 
 		BOOST_FOREACH(auto p2, ga._powers)
 		{
 			if (power.first->_name == p2.first->_name)
 			{
-				std::cout << ValueHand(p2.first->_hand);
+				std::cout << p2.first->Score()._handValue;
 				break;
 			}
 		}